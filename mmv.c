@@ -46,14 +46,53 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
-#include <utime.h>
 #include <dirent.h>
 #include <limits.h>
+#include <regex.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+#ifdef HAVE_SYS_STATFS_H
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#endif
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#ifdef HAVE_LINUX_FIEMAP_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#if defined __GNUC__ && defined __x86_64__
+#include <nmmintrin.h>
+#endif
 
 #include "progname.h"
 #include "binary-io.h"
 #include "dirname.h"
 #include "pathmax.h"
+#include "stat-time.h"
 #include "xalloc.h"
 
 #include "cmdline.h"
@@ -68,6 +107,12 @@
 
 #define STRLEN(s) (sizeof(s) - 1)
 
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN 0
+#define DT_DIR 4
+#define DT_LNK 10
+#endif
+
 
 #define NORMCOPY 0x002
 #define OVERWRITE 0x004
@@ -110,27 +155,61 @@ static char LINKNAME[] = "mln";
 #define FI_CANWRITE 0x20
 #define FI_ISDIR 0x40
 #define FI_ISLNK 0x80
-
-typedef struct {
-	char *fi_name;
-	struct rep *fi_rep;
-	mode_t fi_mode;
-	int fi_stflags;
-} FILEINFO;
-
-#define DI_KNOWWRITE 0x01
-#define DI_CANWRITE 0x02
-#define DI_NONEXISTENT 0x04
-
-typedef struct {
+#define FI_MODEREAD 0x100
+#define FI_MODEWRITE 0x200
+#define FI_GONE 0x400
+
+/* A file is identified by its index in its directory's listing. */
+typedef uint32_t FILENO;
+#define NOFILE ((FILENO)-1)
+
+/* Index of a file's REP in reptab. */
+typedef uint32_t REPNO;
+#define NOREP 0
+#define MISTAKEREP 1
+#define STREAMREP 2		/* done by --stream, and not to be matched again */
+
+#define DI_KNOWWRITE 0x01u
+#define DI_CANWRITE 0x02u
+#define DI_NONEXISTENT 0x04u
+#define DI_CACHEABLE 0x08u
+#define DI_MODEWRITE 0x10u
+#define DI_KNOWTRUST 0x20u
+#define DI_TRUSTMODE 0x40u
+#define DI_EVICTED 0x80u
+#define DI_NOTWHOLE 0x100u	/* --dir-rename cannot move it whole */
+
+/* Directory listing, sorted by name. The names are stored end to end in
+   di_names, and the per-file data in parallel arrays indexed by FILENO, so
+   that searches and scans read memory sequentially. */
+typedef struct dirinfo {
 	dev_t di_vid;
 	ino_t di_did;
-	size_t di_nfils;
-	FILEINFO **di_fils;
-	char di_flags;
-	const char *di_path; /* Only set when DI_NONEXISTENT is set */
+	FILENO di_nfils;
+	char *di_names;
+	uint32_t *di_off;		/* offset of each name in di_names */
+	unsigned short *di_len;	/* length of each name */
+	unsigned char *di_type;	/* d_type of each file, or DT_UNKNOWN */
+	size_t di_nameslen;
+	struct timespec di_ctime, di_mtime;
+	unsigned short *di_stflags;
+	mode_t *di_mode;
+	REPNO *di_rep;
+	unsigned short di_flags;
+	const char *di_path;	/* as given, for reopening and making */
+	int di_fd;				/* open directory, or -1 */
+	struct dirinfo *di_parent;	/* in the trie of directories to be made */
+	const char *di_base;	/* last component of di_path, in the trie */
+	struct dirinfo *di_lrunext, *di_lruprev;	/* open directories, most recent first */
+	unsigned di_pins;		/* reasons to keep the listing in memory */
+	FILENO *di_new;			/* with --watch, the files to match, in order */
+	FILENO di_nnew;			/* how many, or NOFILE for all of them */
+	FILENO di_room;			/* with --watch, the entries there is room for */
+	size_t di_namesroom;	/* and the bytes of names */
 } DIRINFO;
 
+#define FNAME(d, f) ((d)->di_names + (d)->di_off[f])
+
 #define H_NODIR 1
 #define H_NOREADDIR 2
 
@@ -145,13 +224,16 @@ typedef struct {
 #define R_ISALIASED 0x08
 #define R_ISCYCLE 0x10
 #define R_ONEDIRLINK 0x20
+#define R_DONE 0x40
+#define R_PREFETCHED 0x80
+#define R_DIRMOVE 0x100
 
 typedef struct rep {
 	HANDLE *r_hfrom;
-	FILEINFO *r_ffrom;
+	FILENO r_ffrom;			/* in r_hfrom->h_di */
 	HANDLE *r_hto;
 	char *r_nto;			/* non-path part of new name */
-	FILEINFO *r_fdel;
+	FILENO r_fdel;			/* in r_hto->h_di, or NOFILE */
 	struct rep *r_first;
 	struct rep *r_thendo;
 	struct rep *r_next;
@@ -166,17 +248,28 @@ typedef struct {
 } REPDICT;
 
 
-static int op, badstyle, delstyle, verbose, noex, matchall, mkdirs;
+static int op, badstyle, delstyle, verbose, noex, matchall, mkdirs, regexmode, sched, dirrename, stream;
+
+static char **excludes;
+static unsigned nexcludes = 0;
+static int maxdepth = -1;
+static size_t maxmem = 0, listmem = 0;
+static int watchfd = -1, watching = 0;
+static unsigned nbatches = 0;		/* with --watch, the batches with actions */
+static unsigned long shardi = 0, shardn = 0;
 
 static size_t ndirs = 0, dirroom;
-static size_t ndirs_nonexistent = 0, dirroom_nonexistent;
-static DIRINFO **dirs, **dirs_nonexistent;
+static DIRINFO **dirs;
 static size_t nhandles = 0, handleroom;
 static HANDLE **handles;
-static unsigned nreps = 0;
+static unsigned nreps = 0, nstreamed = 0, nstreamdone = 0;
+static FILE *streamlog = NULL;		/* the actions streamed and done */
 static REP hrep, *lastrep = &hrep;
+static size_t nreptab = 0, reptabroom;
+static REP **reptab;
 
 static int badreps = 0, paterr = 0, direrr, failed = 0, gotsig = 0, repbad;
+static int doing = 0;		/* in doreps, where a failure is not to quit */
 
 static char TEMP[] = "$$mmvtmp.";
 static char TOOLONG[] = "(too long)";
@@ -188,9 +281,13 @@ static char SLASHSTR[] = {SLASH, '\0'};
 
 char from[MAXPATLEN], to[MAXPATLEN];
 static size_t fromlen, tolen;
+static char **tos;
+static unsigned ntos = 1;
 static char *(stagel[MAXWILD]), *(firstwild[MAXWILD]), *(stager[MAXWILD]);
 static int nwilds[MAXWILD];
 static int nstages;
+static regex_t stagere[MAXWILD];
+static bool stageisre[MAXWILD];
 char pathbuf[PATH_MAX];
 char fullrep[PATH_MAX + 1];
 static char *(start[MAXWILD]);
@@ -198,18 +295,45 @@ static size_t length[MAXWILD];
 static REP mistake;
 #define MISTAKE (&mistake)
 
+#define FREP(d, f) (reptab[(d)->di_rep[f]])
+
 
 static const char *home;
 static size_t homelen;
 static uid_t uid;
+static gid_t gid;
+static gid_t *supgroups;
+static int nsupgroups = 0;
 static mode_t oldumask;
 static ino_t cwdd = (ino_t)-1L;
 static dev_t cwdv = (dev_t)-1L;
 
 
+/* Copy the log of the actions streamed and done to fp. */
+static void streamshow(FILE *fp)
+{
+	char buf[BUFSIZ];
+	size_t k;
+
+	if (streamlog == NULL)
+		return;
+	fflush(fp);
+	rewind(streamlog);
+	while ((k = fread(buf, 1, sizeof(buf), streamlog)) > 0)
+		fwrite(buf, 1, k, fp);
+	fseek(streamlog, 0L, SEEK_END);
+}
+
 static void quit(void)
 {
-	fprintf(stderr, "Aborting, nothing done.\n");
+	if (nstreamdone != 0) {
+		fprintf(stderr, "Aborting; only these actions, streamed, were done:\n");
+		streamshow(stderr);
+	}
+	else if (nbatches != 0)
+		fprintf(stderr, "Aborting; only the earlier batches were done.\n");
+	else
+		fprintf(stderr, "Aborting, nothing done.\n");
 	exit(1);
 }
 
@@ -229,14 +353,32 @@ static void breakstat(int signum _GL_UNUSED)
 	_exit(1);
 }
 
+static REPNO repadd(REP *p);
+
+/* p is dropped: its source's entry moves on to the next good rep for it,
+   and is only marked a mistake when none is left. */
+static void repdrop(REP *p)
+{
+	DIRINFO *d = p->r_hfrom->h_di;
+
+	if (d->di_rep[p->r_ffrom] != NOREP && FREP(d, p->r_ffrom) != p)
+		return;
+	for (REP *q = p->r_next; q != NULL && q->r_hfrom == p->r_hfrom && q->r_ffrom == p->r_ffrom; q = q->r_next)
+		if (!(q->r_flags & R_SKIP)) {
+			d->di_rep[p->r_ffrom] = repadd(q);
+			return;
+		}
+	d->di_rep[p->r_ffrom] = MISTAKEREP;
+}
+
 static void printchain(REP *p)
 {
 	if (p->r_thendo != NULL)
 		printchain(p->r_thendo);
-	printf("%s%s -> ", p->r_hfrom->h_name, p->r_ffrom->fi_name);
+	printf("%s%s -> ", p->r_hfrom->h_name, FNAME(p->r_hfrom->h_di, p->r_ffrom));
 	badreps++;
 	nreps--;
-	p->r_ffrom->fi_rep = MISTAKE;
+	repdrop(p);
 }
 
 static void nochains(void)
@@ -277,7 +419,10 @@ static void goonordie(void)
 	if ((paterr || badreps) && nreps > 0) {
 		fprintf(stderr, "Not everything specified can be done.");
 		if (badstyle == ABORTBAD) {
-			fprintf(stderr, " Aborting.\n");
+			if (nbatches != 0)
+				fprintf(stderr, " Aborting; only the earlier batches were done.\n");
+			else
+				fprintf(stderr, " Aborting.\n");
 			exit(1);
 		}
 		else if (badstyle == SKIPBAD)
@@ -290,19 +435,22 @@ static void goonordie(void)
 	}
 }
 
-static int trymatch(FILEINFO *ffrom, char *pat)
+static int trymatch(DIRINFO *d, FILENO ffrom, char *pat)
 {
 	char *p;
 
-	if (ffrom->fi_rep != NULL)
+	if (d->di_rep[ffrom] != NOREP)
 		return(0);
 
-	p = ffrom->fi_name;
+	p = FNAME(d, ffrom);
 
 	if (*p == '.') {
 		if (p[1] == '\0' || (p[1] == '.' && p[2] == '\0'))
 			return(strcmp(pat, p) == 0);
-		else if (!matchall && *pat != '.')
+		else if (
+			!matchall &&
+			(regexmode ? !(pat[0] == ESC && pat[1] == '.') : *pat != '.')
+		)
 			return(0);
 	}
 	return(-1);
@@ -392,15 +540,268 @@ static int match(char *pat, char *s, char **start1, size_t *len1)
 		}
 }
 
-static int getstat(char *ffull, FILEINFO *f)
+/* Check an --exclude pattern, which is matched against single names. */
+static int badexclude(const char *pat)
+{
+	int nwild = 0;
+
+	for (const char *p = pat; *p != '\0'; p++)
+		switch (*p) {
+		case SLASH:
+		case ';':
+			return(1);
+		case '*':
+		case '?':
+			if (nwild++ == MAXWILD)
+				return(1);
+			break;
+		case '[':
+			if (nwild++ == MAXWILD)
+				return(1);
+			while (*(++p) != ']')
+				if (*p == '\0' || *p == SLASH || (*p == ESC && *(++p) == '\0'))
+					return(1);
+			break;
+		case ESC:
+			if (*(++p) == '\0')
+				return(1);
+		}
+	return(0);
+}
+
+/* Is a directory excluded from ; descent? Only asked once name is known
+   to be a directory, so that files are never reported as excluded. */
+static int excluded(char *name)
+{
+	char *starts[MAXWILD];
+	size_t lens[MAXWILD];
+
+	for (unsigned i = 0; i < nexcludes; i++)
+		if (match(excludes[i], name, starts, lens)) {
+			if (verbose)
+				printf("excluding %s\n", name);
+			return(1);
+		}
+	return(0);
+}
+
+/* Match a name against the regular expression of a stage, which is
+   anchored by an extra group around it. */
+static int rematch(int stage, char *s, char **start1, size_t *len1)
+{
+	regmatch_t pm[MAXWILD + 2];
+	size_t ngroups = stagere[stage].re_nsub - 1;
+
+	if (regexec(&stagere[stage], s, ngroups + 2, pm, 0) != 0)
+		return(0);
+	for (size_t i = 0; i < ngroups; i++)
+		if (pm[i + 2].rm_so < 0) {
+			start1[i] = s;
+			len1[i] = 0;
+		}
+		else {
+			start1[i] = s + pm[i + 2].rm_so;
+			len1[i] = (size_t)(pm[i + 2].rm_eo - pm[i + 2].rm_so);
+		}
+	return(1);
+}
+
+/* Directory file descriptors
+
+   Directories are opened once and then searched relative to their fd, so
+   that the kernel does not resolve the whole path again for every file.
+   At most maxdirfds are kept open; beyond that the least recently used is
+   closed, and reopened by path if it is needed again, after checking that
+   the path still leads to the same directory. */
+
+static DIRINFO *lruhead = NULL, *lrutail = NULL;
+static unsigned ndirfds = 0, maxdirfds = 0;
+
+static void lruunlink(DIRINFO *di)
+{
+	if (di->di_lruprev != NULL)
+		di->di_lruprev->di_lrunext = di->di_lrunext;
+	else
+		lruhead = di->di_lrunext;
+	if (di->di_lrunext != NULL)
+		di->di_lrunext->di_lruprev = di->di_lruprev;
+	else
+		lrutail = di->di_lruprev;
+}
+
+static void lrufront(DIRINFO *di)
+{
+	di->di_lruprev = NULL;
+	di->di_lrunext = lruhead;
+	if (lruhead != NULL)
+		lruhead->di_lruprev = di;
+	else
+		lrutail = di;
+	lruhead = di;
+}
+
+/* Make room for another open directory. */
+static void dfdroom(void)
+{
+	if (maxdirfds == 0) {
+		maxdirfds = 64;
+#ifdef HAVE_SYS_RESOURCE_H
+		struct rlimit rl;
+		/* Leave plenty of descriptors for files and everything else. */
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+			if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur / 2 > 1024)
+				maxdirfds = 1024;
+			else
+				maxdirfds = rl.rlim_cur / 2 > 4 ? (unsigned)(rl.rlim_cur / 2) : 4;
+		}
+#endif
+	}
+	while (ndirfds >= maxdirfds && lrutail != NULL) {
+		DIRINFO *old = lrutail;
+		lruunlink(old);
+		close(old->di_fd);
+		old->di_fd = -1;
+		ndirfds--;
+	}
+}
+
+/* Take ownership of fd, an open descriptor for di. */
+static void dsetfd(DIRINFO *di, int fd)
+{
+	dfdroom();
+	di->di_fd = fd;
+	lrufront(di);
+	ndirfds++;
+}
+
+/* Return an open descriptor for di, reopening it if need be. Once the
+   actions are being done, one that cannot be reopened gives -1, so that
+   the action fails and is reported rather than the job quitting. */
+static int dfd(DIRINFO *di)
+{
+	struct stat dstat;
+	int fd;
+
+	if (di->di_fd >= 0) {
+		if (di != lruhead) {
+			lruunlink(di);
+			lrufront(di);
+		}
+		return(di->di_fd);
+	}
+
+	dfdroom();
+	if (
+		(fd = open(di->di_path, O_RDONLY | O_DIRECTORY)) < 0 ||
+		fstat(fd, &dstat) ||
+		dstat.st_dev != di->di_vid ||
+		dstat.st_ino != di->di_did
+	) {
+		fprintf(stderr, "Strange, can't reopen directory %s.\n", di->di_path);
+		if (!doing)
+			quit();
+		if (fd >= 0)
+			close(fd);
+		return(-1);
+	}
+	dsetfd(di, fd);
+	return(fd);
+}
+
+/* Permissions
+
+   Whether a file can be read or written is normally worked out from the
+   mode, owner and group found by getstat, in the same way as access(2)
+   does, which saves a system call per file. That is only trusted where the
+   mode tells the whole story: on a local, writable file system that does
+   not support POSIX ACLs at all, since any file could otherwise have an ACL
+   of its own granting or refusing what its mode does not. Elsewhere, and on
+   systems where this cannot be checked, faccessat is asked instead. An
+   immutable flag or a security module can still refuse what the mode
+   allows; the action then fails and is reported like any other. */
+
+#if defined __linux__ && defined HAVE_SYS_STATFS_H && defined HAVE_SYS_XATTR_H
+#define MODEPERMS 1
+#endif
+
+/* Does the mode in st grant the real user the permission bit perm, given
+   as its owner bit (S_IRUSR or S_IWUSR)? */
+static int modeperm(const struct stat *st, mode_t perm)
+{
+	if (uid == 0)
+		return(1);
+	if (st->st_uid == uid)
+		return((st->st_mode & perm) != 0);
+	int ingroup = st->st_gid == gid;
+	for (int i = 0; !ingroup && i < nsupgroups; i++)
+		ingroup = st->st_gid == supgroups[i];
+	return((st->st_mode & (ingroup ? perm >> 3 : perm >> 6)) != 0);
+}
+
+#ifdef MODEPERMS
+/* File systems whose servers decide permissions for themselves. */
+static const unsigned long netfs[] = {
+	0x6969,			/* NFS */
+	0x517b,			/* SMB */
+	0xfe534d42,		/* SMB2 */
+	0xff534d42,		/* CIFS */
+	0x65735546,		/* FUSE */
+	0x00c36400,		/* Ceph */
+	0x5346414f,		/* AFS */
+	0x01021997,		/* 9P */
+	0x47504653,		/* GPFS */
+	0x0bd00bd0,		/* Lustre */
+};
+
+/* Is fd on a file system without POSIX ACLs? */
+static int noacls(int fd)
+{
+	return(fgetxattr(fd, "system.posix_acl_access", NULL, 0) < 0 && errno == ENOTSUP);
+}
+#endif
+
+/* Can the mode bits of files in d be trusted? */
+static int trustmode(DIRINFO *d)
+{
+	if (!(d->di_flags & DI_KNOWTRUST)) {
+		d->di_flags |= DI_KNOWTRUST;
+#ifdef MODEPERMS
+		struct statfs fs;
+		int fd = dfd(d);
+		if (fstatfs(fd, &fs) == 0 && !(fs.f_flags & ST_RDONLY)) {
+			size_t i;
+			for (i = 0; i < sizeof(netfs) / sizeof(netfs[0]); i++)
+				if ((unsigned long)fs.f_type == netfs[i])
+					break;
+			if (i == sizeof(netfs) / sizeof(netfs[0]) && noacls(fd))
+				d->di_flags |= DI_TRUSTMODE;
+		}
+#endif
+	}
+	return(d->di_flags & DI_TRUSTMODE);
+}
+
+/* Can the real user read file f of d? */
+static int freadable(DIRINFO *d, FILENO f)
+{
+	int flags = d->di_stflags[f];
+
+	if ((flags & FI_STTAKEN) && !(flags & FI_LINKERR) && trustmode(d))
+		return((flags & FI_MODEREAD) != 0);
+	return(!faccessat(dfd(d), FNAME(d, f), R_OK, 0));
+}
+
+static int getstat(char *ffull, DIRINFO *d, FILENO f)
 {
 	struct stat fstat;
 	int flags;
 
-	if ((flags = f->fi_stflags) & FI_STTAKEN)
+	if ((flags = d->di_stflags[f]) & FI_STTAKEN)
 		return(flags & FI_LINKERR);
 	flags |= FI_STTAKEN;
-	if (lstat(ffull, &fstat)) {
+	int fd = dfd(d);
+	const char *name = FNAME(d, f);
+	if (fstatat(fd, name, &fstat, AT_SYMLINK_NOFOLLOW)) {
 		fprintf(stderr, "Strange, couldn't lstat %s.\n", ffull);
 		quit();
 	}
@@ -409,34 +810,50 @@ static int getstat(char *ffull, FILEINFO *f)
 #ifdef S_IFLNK
 	if ((fstat.st_mode & S_IFMT) == S_IFLNK) {
 		flags |= FI_ISLNK;
-		if (stat(ffull, &fstat)) {
-			f->fi_stflags = flags | FI_LINKERR;
+		if (fstatat(fd, name, &fstat, 0)) {
+			d->di_stflags[f] = (unsigned short)(flags | FI_LINKERR);
 			return(1);
 		}
 	}
 #endif
 	if ((fstat.st_mode & S_IFMT) == S_IFDIR)
 		flags |= FI_ISDIR;
-	f->fi_stflags = flags;
-	f->fi_mode = fstat.st_mode;
+	if (modeperm(&fstat, S_IRUSR))
+		flags |= FI_MODEREAD;
+	if (modeperm(&fstat, S_IWUSR))
+		flags |= FI_MODEWRITE;
+	d->di_stflags[f] = (unsigned short)flags;
+	d->di_mode[f] = fstat.st_mode;
 	return(0);
 }
 
-static int keepmatch(FILEINFO *ffrom, char *pathend, size_t *pk, int needslash, int fils)
+static int keepmatch(DIRINFO *d, FILENO ffrom, char *pathend, size_t *pk, int needslash, int fils)
 {
-	*pk = strlen(ffrom->fi_name);
+	char *name = FNAME(d, ffrom);
+
+	*pk = d->di_len[ffrom];
 	if ((size_t)(pathend - pathbuf) + *pk + (size_t)needslash >= PATH_MAX) {
 		*pathend = '\0';
 		printf("%s -> %s : search path %s%s too long.\n",
-			from, to, pathbuf, ffrom->fi_name);
+			from, to, pathbuf, name);
 		paterr = 1;
 		return(0);
 	}
-	strcpy(pathend, ffrom->fi_name);
-	getstat(pathbuf, ffrom);
-	if (!(ffrom->fi_stflags & FI_ISDIR) && !fils) {
+	memcpy(pathend, name, *pk + 1);
+	if (
+		!fils &&
+		d->di_type[ffrom] != DT_UNKNOWN &&
+		d->di_type[ffrom] != DT_DIR &&
+		d->di_type[ffrom] != DT_LNK
+	) {
+		if (verbose)
+			printf("ignoring file %s\n", name);
+		return(0);
+	}
+	getstat(pathbuf, d, ffrom);
+	if (!(d->di_stflags[ffrom] & FI_ISDIR) && !fils) {
 		if (verbose)
-			printf("ignoring file %s\n", ffrom->fi_name);
+			printf("ignoring file %s\n", name);
 		return(0);
 	}
 
@@ -464,31 +881,43 @@ static char *getpath(char *tpath)
 	return(pathend);
 }
 
-static int fcmp(const void *pf1, const void *pf2)
+static _GL_ATTRIBUTE_PURE FILENO fsearch(const char *s, DIRINFO *d)
 {
-	return(strcmp((*(FILEINFO **)pf1)->fi_name, (*(FILEINFO **)pf2)->fi_name));
+	FILENO first = 0, last = d->di_nfils;
+
+	while (first < last) {
+		FILENO k = first + (last - first) / 2;
+		int res = strcmp(s, FNAME(d, k));
+		if (res == 0)
+			return(k);
+		else if (res > 0)
+			first = k + 1;
+		else
+			last = k;
+	}
+	return(NOFILE);
 }
 
-static FILEINFO *fsearch(char *s, DIRINFO *d)
+/* Find s in d as a target; a file already moved away by --stream is not
+   there any more. */
+static _GL_ATTRIBUTE_PURE FILENO ftarget(const char *s, DIRINFO *d)
 {
-	FILEINFO *f = (FILEINFO *)xmalloc(sizeof(FILEINFO));
-	f->fi_name = s;
-	FILEINFO **res = bsearch(&f, d->di_fils, d->di_nfils, sizeof(FILEINFO *), fcmp);
-	return res != NULL ? *res : NULL;
+	FILENO f = fsearch(s, d);
+
+	return(f != NOFILE && (d->di_stflags[f] & FI_GONE) ? NOFILE : f);
 }
 
-static _GL_ATTRIBUTE_PURE size_t ffirst(char *s, size_t n, DIRINFO *d)
+static _GL_ATTRIBUTE_PURE FILENO ffirst(char *s, size_t n, DIRINFO *d)
 {
-	FILEINFO **fils = d->di_fils;
-	size_t nfils = d->di_nfils;
+	FILENO nfils = d->di_nfils;
 
 	if (nfils == 0 || n == 0)
 		return(0);
-	size_t first = 0;
-	size_t last = nfils - 1;
+	FILENO first = 0;
+	FILENO last = nfils - 1;
 	for(;;) {
-		size_t k = (first + last) / 2;
-		int res = strncmp(s, fils[k]->fi_name, n);
+		FILENO k = first + (last - first) / 2;
+		int res = strncmp(s, FNAME(d, k), n);
 		if (first == last)
 			return(res == 0 ? k : nfils);
 		else if (res > 0)
@@ -501,99 +930,39 @@ static _GL_ATTRIBUTE_PURE size_t ffirst(char *s, size_t n, DIRINFO *d)
 #define IRWXMASK (S_IRUSR | S_IWUSR | S_IXUSR)
 #define RWXMASK (IRWXMASK | (IRWXMASK >> 3) | (IRWXMASK >> 6))
 
-/* This function adapted from bash's mkdir.c
-   Make all the directories leading up to PATH, then create PATH.  Note that
-   this changes the process's umask; make sure that all paths leading to a
-   return reset it to OLDUMASK */
-static int make_path(char *path)
+/* Make the directory di, and any missing directories above it, each with
+   mkdirat relative to its parent. */
+static int dmake(DIRINFO *di)
 {
-	struct stat sb;
-	char *p, *npath;
-	int tail;
-
-	/* If we don't have to do any work, don't do any work. */
-	if (stat(path, &sb) == 0) {
-		if (S_ISDIR(sb.st_mode) == 0) {
-			if (verbose)
-				printf("`%s': file exists but is not a directory", path);
-			return(1);
-		}
+	struct stat dstat;
+	DIRINFO *parent = di->di_parent;
 
+	if (!(di->di_flags & DI_NONEXISTENT))
 		return(0);
+	if (dmake(parent))
+		return(1);
+	int pfd = dfd(parent);
+	if (mkdirat(pfd, di->di_base, ~oldumask & RWXMASK) < 0 && errno != EEXIST) {
+		if (verbose)
+			printf("cannot create directory `%s': %s\n", di->di_path, strerror(errno));
+		return(1);
 	}
-
-	npath = xstrdup(path);	/* So we can write to it. */
-
-	/* Check whether or not we need to do anything with intermediate dirs. */
-
-	/* Skip leading slashes. */
-	p = npath;
-	while (*p == '/')
-		p++;
-
-	tail = 0;
-	while (tail == 0) {
-		if (*p == '\0')
-			tail = 1;
-		else
-			p = strchr(p, '/');
-		if (p)
-			*p = '\0';
-		else
-			tail = 1;
-		if (mkdir(npath, ~oldumask & RWXMASK) < 0) {
-			/* "Each dir operand that names an existing directory shall be
-			   ignored without error." */
-			if (errno == EEXIST || errno == EISDIR) {
-				int e = errno;
-				int fail = 0;
-
-				if (stat(npath, &sb) != 0) {
-					fail = 1;
-					if (verbose)
-						printf("cannot create directory `%s': %s", npath, strerror(e));
-				}
-				else if (e == EEXIST && S_ISDIR(sb.st_mode) == 0) {
-					fail = 1;
-					if (verbose)
-						printf("`%s': file exists but is not a directory", npath);
-				}
-				if (fail) {
-					umask(oldumask);
-					return(1);
-				}
-			}
-			else {
-				if (verbose)
-					printf("cannot create directory `%s': %s", npath, strerror(errno));
-				umask(oldumask);
-				return(1);
-			}
-		}
-		if (tail == 0)
-			*p++ = '/';	/* restore slash */
-		while (p && *p == '/')	/* skip consecutive slashes or trailing slash */
-			p++;
+	if (fstatat(pfd, di->di_base, &dstat, 0) || (dstat.st_mode & S_IFMT) != S_IFDIR) {
+		if (verbose)
+			printf("`%s': file exists but is not a directory\n", di->di_path);
+		return(1);
 	}
-
-	umask(oldumask);
+	di->di_vid = dstat.st_dev;
+	di->di_did = dstat.st_ino;
+	di->di_flags &= (unsigned short)~DI_NONEXISTENT;
 	return(0);
 }
 
 /* Create a non-existent directory and update its DIRINFO. */
 static int make_directory(HANDLE *h) {
-	int res = make_path(h->h_name);
+	int res = dmake(h->h_di);
 	if (res != 0)
 		fprintf(stderr, "Strange, couldn't create directory %s.\n",  h->h_name);
-	else {
-		struct stat dstat;
-		if (stat(h->h_name, &dstat) || (dstat.st_mode & S_IFMT) != S_IFDIR) {
-			fprintf(stderr, "Strange, couldn't stat new directory %s.\n", h->h_name);
-			res = -1;
-		}
-		h->h_di->di_vid = dstat.st_dev;
-		h->h_di->di_did = dstat.st_ino;
-	}
 	return res;
 }
 
@@ -625,32 +994,16 @@ static DIRINFO *dadd(dev_t v, ino_t d)
 {
 	if (ndirs == dirroom)
 		dirs = (DIRINFO **)x2nrealloc(dirs, &dirroom, sizeof(DIRINFO *));
-	DIRINFO *di = (DIRINFO *)xmalloc(sizeof(DIRINFO));
+	DIRINFO *di = (DIRINFO *)xzalloc(sizeof(DIRINFO));
 	di->di_vid = v;
 	di->di_did = d;
-	di->di_nfils = 0;
-	di->di_fils = NULL;
 	di->di_flags = 0;
 	di->di_path = NULL;
+	di->di_fd = -1;
 	dirs[ndirs++] = di;
 	return(di);
 }
 
-static DIRINFO *dadd_nonexistent(const char *dir)
-{
-	if (ndirs_nonexistent == dirroom_nonexistent)
-		dirs_nonexistent = (DIRINFO **)x2nrealloc(dirs_nonexistent, &dirroom_nonexistent, sizeof(DIRINFO *));
-	DIRINFO *di = (DIRINFO *)xmalloc(sizeof(DIRINFO));
-	di->di_vid = (dev_t)-1;
-	di->di_did = (ino_t)-1;
-	di->di_nfils = 0;
-	di->di_fils = NULL;
-	di->di_flags = DI_KNOWWRITE | DI_CANWRITE | DI_NONEXISTENT;
-	di->di_path = xstrdup(dir);
-	dirs_nonexistent[ndirs_nonexistent++] = di;
-	return(di);
-}
-
 static _GL_ATTRIBUTE_PURE DIRINFO *dsearch(dev_t v, ino_t d)
 {
 	for (unsigned i = 0; i < ndirs; i++)
@@ -659,113 +1012,765 @@ static _GL_ATTRIBUTE_PURE DIRINFO *dsearch(dev_t v, ino_t d)
 	return(NULL);
 }
 
-static _GL_ATTRIBUTE_PURE DIRINFO *dsearch_nonexistent(const char *dir)
+/* Directories to be made
+
+   The directories named by target paths that do not exist yet, together
+   with their ancestors up to one that does, form a trie whose nodes are
+   DIRINFOs, found by parent and name in a hash table. Each component is
+   looked up once, and each missing directory is made only once, by dmake. */
+
+static DIRINFO **dtrie = NULL;
+static size_t dtrieroom = 0, ndtrie = 0;
+static DIRINFO *dtrieroot[2];		/* "." and "/" */
+
+static _GL_ATTRIBUTE_PURE size_t dtriehash(const DIRINFO *parent, const char *name, size_t len)
 {
-	for (unsigned i = 0; i < ndirs_nonexistent; i++)
-		if (strcmp(dirs_nonexistent[i]->di_path, dir) == 0)
-			return(dirs_nonexistent[i]);
-	return(NULL);
+	uint32_t h = 2166136261u ^ (uint32_t)(uintptr_t)parent;
+
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	return(h);
 }
 
-static void takedir(const char *p, DIRINFO *di, int sticky)
+static DIRINFO **dtrieslot(const DIRINFO *parent, const char *name, size_t len)
 {
-	struct dirent *dp;
-	FILEINFO *f, **fils;
-	DIR *dirp;
+	size_t i = dtriehash(parent, name, len) & (dtrieroom - 1);
+	DIRINFO *di;
 
-	if ((dirp = opendir(p)) == NULL) {
-		fprintf(stderr, "Strange, can't scan %s.\n", p);
-		quit();
-	}
-	size_t room = INITROOM;
-	di->di_fils = fils = (FILEINFO **)xmalloc(room * sizeof(FILEINFO *));
-	size_t cnt = 0;
-	while ((dp = readdir(dirp)) != NULL) {
-		if (cnt == room) {
-			di->di_fils = (FILEINFO **)x2nrealloc(di->di_fils, &room, sizeof(FILEINFO *));
-			fils = di->di_fils + cnt;
-		}
-		*fils = f = (FILEINFO *)xmalloc(sizeof(FILEINFO));
-		f->fi_name = xstrdup(dp->d_name);
-		f->fi_stflags = sticky;
-		f->fi_rep = NULL;
-		cnt++;
-		fils++;
-	}
-	closedir(dirp);
-	qsort(di->di_fils, cnt, sizeof(FILEINFO *), fcmp);
-	di->di_nfils = cnt;
+	while (
+		(di = dtrie[i]) != NULL &&
+		!(
+			di->di_parent == parent &&
+			strncmp(di->di_base, name, len) == 0 &&
+			di->di_base[len] == '\0'
+		)
+	)
+		i = (i + 1) & (dtrieroom - 1);
+	return(&dtrie[i]);
 }
 
-static HANDLE *checkdir(char *p, char *pathend, int makedirs)
+static DIRINFO *dtrienode(DIRINFO *parent, const char *path, size_t pathlen, int exists)
 {
+	DIRINFO *di = (DIRINFO *)xzalloc(sizeof(DIRINFO));
+	char *dpath = xcharalloc(pathlen + 1);
 	struct stat dstat;
-	ino_t d;
-	dev_t v;
-	DIRINFO *di = NULL;
-	const char *myp;
-	char *lastslash = NULL;
-	int sticky;
-	HANDLE *h;
 
-	if (hsearch(p, &h)) {
-		if (h->h_di == NULL) {
-			direrr = h->h_err;
-			return(NULL);
-		}
-		return(h);
+	memcpy(dpath, path, pathlen);
+	dpath[pathlen] = '\0';
+	di->di_path = dpath;
+	di->di_base = dpath + pathlen;
+	while (di->di_base > dpath && di->di_base[-1] != SLASH)
+		di->di_base--;
+	di->di_parent = parent;
+	di->di_fd = -1;
+	if (
+		exists &&
+		(parent == NULL ? stat(dpath, &dstat) : fstatat(dfd(parent), di->di_base, &dstat, 0)) == 0 &&
+		(dstat.st_mode & S_IFMT) == S_IFDIR
+	) {
+		di->di_vid = dstat.st_dev;
+		di->di_did = dstat.st_ino;
 	}
-
-	if (*p == '\0')
-		myp = ".";
-	else if (pathend == p + 1)
-		myp = SLASHSTR;
 	else {
-		lastslash = pathend - 1;
-		*lastslash = '\0';
-		myp = p;
+		di->di_vid = (dev_t)-1;
+		di->di_did = (ino_t)-1;
+		di->di_flags = DI_KNOWWRITE | DI_CANWRITE | DI_NONEXISTENT;
 	}
+	return(di);
+}
 
-	if (stat(myp, &dstat) || (dstat.st_mode & S_IFMT) != S_IFDIR) {
-		if (makedirs) {
-			if ((di = dsearch_nonexistent(myp)) == NULL)
-				di = dadd_nonexistent(myp);
-		} else
-			direrr = h->h_err = H_NODIR;
-	} else if (access(myp, R_OK | X_OK))
-		direrr = h->h_err = H_NOREADDIR;
-	else {
-		direrr = 0;
-		sticky = (dstat.st_mode & S_ISVTX) && uid != 0 && uid != dstat.st_uid ?
-			FI_INSTICKY : 0;
-		v = dstat.st_dev;
-		d = dstat.st_ino;
+/* Return the trie node for the directory dir, which does not exist. */
+static DIRINFO *dtrieadd(const char *dir)
+{
+	const char *p = dir, *q;
+	int absolute = *dir == SLASH;
+	DIRINFO *di;
 
-		if ((di = dsearch(v, d)) == NULL)
-			takedir(myp, di = dadd(v, d), sticky);
+	if (dtrieroom == 0) {
+		dtrieroom = 64;
+		dtrie = (DIRINFO **)xcalloc(dtrieroom, sizeof(DIRINFO *));
 	}
+	if ((di = dtrieroot[absolute]) == NULL)
+		di = dtrieroot[absolute] = dtrienode(NULL, absolute ? SLASHSTR : ".", 1, 1);
 
-	if (lastslash != NULL)
-		*lastslash = SLASH;
-	if (direrr != 0)
-		return(NULL);
-	h->h_di = di;
-	return(h);
+	for (;;) {
+		while (*p == SLASH)
+			p++;
+		if (*p == '\0')
+			return(di);
+		for (q = p; *q != '\0' && *q != SLASH; q++)
+			;
+		DIRINFO **slot = dtrieslot(di, p, (size_t)(q - p));
+		if (*slot == NULL) {
+			*slot = dtrienode(di, dir, (size_t)(q - dir),
+				!(di->di_flags & DI_NONEXISTENT));
+			if (++ndtrie * 2 > dtrieroom) {
+				DIRINFO **old = dtrie;
+				size_t oldroom = dtrieroom;
+				dtrieroom *= 2;
+				dtrie = (DIRINFO **)xcalloc(dtrieroom, sizeof(DIRINFO *));
+				for (size_t i = 0; i < oldroom; i++)
+					if (old[i] != NULL)
+						*dtrieslot(old[i]->di_parent, old[i]->di_base,
+							strlen(old[i]->di_base)) = old[i];
+				free(old);
+				slot = dtrieslot(di, p, (size_t)(q - p));
+			}
+		}
+		di = *slot;
+		p = q;
+	}
 }
 
-static int checkto(char *f, HANDLE **phto, char **pnto, FILEINFO **pfdel)
+/* Names are sorted with a multikey quicksort on 4-byte chunks, which gives
+   the same order as strcmp. Each entry caches the chunk of its name at the
+   current depth, so most comparisons never touch the names themselves. */
+typedef struct {
+	uint32_t sk_key;		/* bytes depth..depth+3 of the name, big-endian */
+	FILENO sk_f;
+} SORTKEY;
+
+#define KEYLEN 4
+#define SMALLSORT 12
+
+static _GL_ATTRIBUTE_PURE uint32_t loadkey(const char *s)
+{
+	uint32_t key = 0;
+	int i;
+
+	for (i = 0; i < KEYLEN && *s != '\0'; i++, s++)
+		key = (key << 8) | (unsigned char)*s;
+	return(i == 0 ? 0 : key << (8 * (KEYLEN - i)));
+}
+
+static void insertsort(SORTKEY *a, size_t n, const char *names, const uint32_t *off, size_t depth)
+{
+	for (size_t i = 1; i < n; i++) {
+		SORTKEY t = a[i];
+		size_t j;
+		for (j = i; j > 0; j--) {
+			uint32_t k = a[j - 1].sk_key;
+			if (
+				k < t.sk_key ||
+				(
+					k == t.sk_key &&
+					((k & 0xff) == 0 ||
+					 strcmp(names + off[a[j - 1].sk_f] + depth + KEYLEN,
+						names + off[t.sk_f] + depth + KEYLEN) <= 0)
+				)
+			)
+				break;
+			a[j] = a[j - 1];
+		}
+		a[j] = t;
+	}
+}
+
+static void namesort(SORTKEY *a, size_t n, const char *names, const uint32_t *off, size_t depth)
+{
+	while (n > SMALLSORT) {
+		uint32_t x = a[0].sk_key, y = a[n / 2].sk_key, z = a[n - 1].sk_key, v;
+		v = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+
+		size_t lt = 0, i = 0, gt = n;
+		while (i < gt) {
+			SORTKEY t = a[i];
+			if (t.sk_key < v) {
+				a[i++] = a[lt];
+				a[lt++] = t;
+			}
+			else if (t.sk_key > v) {
+				a[i] = a[--gt];
+				a[gt] = t;
+			}
+			else
+				i++;
+		}
+
+		/* Recurse on the two smaller partitions and loop on the largest.
+		   The names in the middle partition are equal up to depth + KEYLEN,
+		   and if they end there they are all equal. */
+		size_t nlt = lt, neq = gt - lt, ngt = n - gt;
+		int eqdone = (v & 0xff) == 0;
+		if (eqdone)
+			neq = 0;
+		if (neq >= nlt && neq >= ngt) {
+			namesort(a, nlt, names, off, depth);
+			namesort(a + gt, ngt, names, off, depth);
+			a += lt;
+			n = neq;
+			depth += KEYLEN;
+			for (i = 0; i < n; i++)
+				a[i].sk_key = loadkey(names + off[a[i].sk_f] + depth);
+		}
+		else {
+			if (neq > 0) {
+				for (i = lt; i < gt; i++)
+					a[i].sk_key = loadkey(names + off[a[i].sk_f] + depth + KEYLEN);
+				namesort(a + lt, neq, names, off, depth + KEYLEN);
+			}
+			if (nlt >= ngt) {
+				namesort(a + gt, ngt, names, off, depth);
+				n = nlt;
+			}
+			else {
+				namesort(a, nlt, names, off, depth);
+				a += gt;
+				n = ngt;
+			}
+		}
+	}
+	insertsort(a, n, names, off, depth);
+}
+
+/* Allocate the per-file arrays of a listing of di_nfils names. */
+static void dalloc(DIRINFO *di, int sticky)
+{
+	FILENO cnt = di->di_nfils;
+
+	di->di_stflags = (unsigned short *)xnmalloc(cnt, sizeof(unsigned short));
+	di->di_mode = (mode_t *)xnmalloc(cnt, sizeof(mode_t));
+	di->di_rep = (REPNO *)xcalloc(cnt, sizeof(REPNO));
+	for (FILENO i = 0; i < cnt; i++)
+		di->di_stflags[i] = (unsigned short)sticky;
+}
+
+static _GL_ATTRIBUTE_PURE size_t dlistsize(const DIRINFO *di)
+{
+	return(di->di_nameslen + di->di_nfils * (sizeof(uint32_t) + 2 * sizeof(unsigned short) + 1 +
+		sizeof(mode_t) + sizeof(REPNO)));
+}
+
+static void takedir(const char *p, DIRINFO *di, int sticky)
+{
+	struct dirent *dp;
+	DIR *dirp;
+	int fd = dup(dfd(di));
+
+	if (fd < 0 || (dirp = fdopendir(fd)) == NULL) {
+		fprintf(stderr, "Strange, can't scan %s.\n", p);
+		quit();
+	}
+	/* The descriptor shares its offset with dfd's, which an earlier scan of
+	   an evicted listing will have left at the end. */
+	rewinddir(dirp);
+	size_t room = INITROOM, namesroom = INITROOM * 16, namesused = 0;
+	uint32_t *off = (uint32_t *)xmalloc(room * sizeof(uint32_t));
+	unsigned char *types = (unsigned char *)xmalloc(room);
+	char *names = xcharalloc(namesroom);
+	size_t cnt = 0;
+	while ((dp = readdir(dirp)) != NULL) {
+		size_t len = strlen(dp->d_name) + 1;
+		if (cnt == room) {
+			off = (uint32_t *)x2nrealloc(off, &room, sizeof(uint32_t));
+			types = (unsigned char *)xrealloc(types, room);
+		}
+		while (namesused + len > namesroom)
+			names = (char *)x2nrealloc(names, &namesroom, 1);
+		if (namesused + len > UINT32_MAX || cnt >= NOFILE) {
+			fprintf(stderr, "Strange, %s has too many entries.\n", p);
+			quit();
+		}
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+		types[cnt] = dp->d_type;
+#else
+		types[cnt] = DT_UNKNOWN;
+#endif
+		off[cnt++] = (uint32_t)namesused;
+		memcpy(names + namesused, dp->d_name, len);
+		namesused += len;
+	}
+	closedir(dirp);
+
+	/* Sort the names, then lay them out again in sorted order. */
+	SORTKEY *order = (SORTKEY *)xnmalloc(cnt, sizeof(SORTKEY));
+	for (FILENO i = 0; i < cnt; i++) {
+		order[i].sk_f = i;
+		order[i].sk_key = loadkey(names + off[i]);
+	}
+	namesort(order, cnt, names, off, 0);
+
+	di->di_nfils = (FILENO)cnt;
+	di->di_names = xcharalloc(namesused);
+	di->di_off = (uint32_t *)xnmalloc(cnt, sizeof(uint32_t));
+	di->di_len = (unsigned short *)xnmalloc(cnt, sizeof(unsigned short));
+	di->di_type = (unsigned char *)xmalloc(cnt);
+	char *q = di->di_names;
+	for (FILENO i = 0; i < cnt; i++) {
+		const char *name = names + off[order[i].sk_f];
+		size_t len = strlen(name);
+		di->di_off[i] = (uint32_t)(q - di->di_names);
+		di->di_len[i] = (unsigned short)len;
+		di->di_type[i] = types[order[i].sk_f];
+		memcpy(q, name, len + 1);
+		q += len + 1;
+	}
+	di->di_nameslen = di->di_namesroom = namesused;
+	di->di_room = di->di_nfils;
+	dalloc(di, sticky);
+	listmem += dlistsize(di);
+	free(order);
+	free(off);
+	free(types);
+	free(names);
+}
+
+/* Memory budget
+
+   With --max-memory, once the listings read so far take more than the
+   budget, each one is evicted when dostage has finished with it, unless
+   it is still needed: while dostage is in it, if a planned action is from
+   or to it, or if it is mapped from the directory cache. If an evicted
+   directory is wanted again, it is read again. The sort in
+   checkcollisions is also kept within the budget; see there. */
+
+static void devict(DIRINFO *di)
+{
+	if (
+		listmem <= maxmem || di->di_pins != 0 ||
+		(di->di_flags & (DI_NONEXISTENT | DI_EVICTED)) || di->di_names == NULL
+	)
+		return;
+	for (FILENO f = 0; f < di->di_nfils; f++)
+		if (di->di_rep[f] != NOREP)
+			return;
+	listmem -= dlistsize(di);
+	free(di->di_names);
+	free(di->di_off);
+	free(di->di_len);
+	free(di->di_type);
+	free(di->di_stflags);
+	free(di->di_mode);
+	free(di->di_rep);
+	di->di_names = NULL;
+	di->di_off = NULL;
+	di->di_len = NULL;
+	di->di_type = NULL;
+	di->di_stflags = NULL;
+	di->di_mode = NULL;
+	di->di_rep = NULL;
+	di->di_nfils = di->di_room = 0;
+	di->di_nameslen = di->di_namesroom = 0;
+	di->di_flags = (unsigned short)((di->di_flags & ~DI_CACHEABLE) | DI_EVICTED);
+}
+
+static int dsticky(DIRINFO *di)
+{
+	struct stat dstat;
+
+	return(fstat(dfd(di), &dstat) == 0 && (dstat.st_mode & S_ISVTX) && uid != 0 &&
+		uid != dstat.st_uid ? FI_INSTICKY : 0);
+}
+
+static void dreload(DIRINFO *di)
+{
+	takedir(di->di_path, di, dsticky(di));
+	di->di_flags &= (unsigned short)~DI_EVICTED;
+}
+
+/* Directory cache
+
+   With --dircache, sorted listings are saved between runs in a file that
+   is mapped into memory when it is read back. A listing is only reused if
+   the directory's device, inode, ctime and mtime all match, and is only
+   saved if the directory's ctime was at least DCSLACK seconds old when it
+   was read, so that a change made in the same clock tick as the scan cannot
+   go unnoticed, and as the cache is saved after the job has been done, a
+   directory the job has changed is left out. Only names and types are
+   cached; files are still stat'ed before anything is done with them. The
+   file is in native byte order. */
+
+#define DCMAGIC "mmvdc\0\0\1"
+#define DCSLACK 2
+
+typedef struct {
+	char dh_magic[8];
+	uint32_t dh_order;		/* DCORDER, to detect foreign byte order */
+	uint32_t dh_recsize;	/* sizeof(DCRECORD) */
+	uint64_t dh_ndirs;
+} DCHEADER;
+
+#define DCORDER 0x01020304
+
+/* A listing is stored as di_off, di_len, di_type then di_names. */
+typedef struct {
+	uint64_t dr_dev, dr_ino;
+	int64_t dr_ctime, dr_ctimens, dr_mtime, dr_mtimens;
+	uint64_t dr_data;		/* offset of listing in file */
+	uint64_t dr_nameslen;
+	uint32_t dr_nfils, dr_pad;
+} DCRECORD;
+
+static const char *dcpath = NULL;
+static char *dcmap = NULL;
+static size_t dcsize = 0;
+static DCRECORD *dcrecs = NULL;
+static size_t dcnrecs = 0;
+
+#define DCALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+static uint64_t dclistsize(uint64_t nfils, uint64_t nameslen)
+{
+	return(DCALIGN(nfils * (sizeof(uint32_t) + sizeof(unsigned short) + 1) + nameslen));
+}
+
+static int dcreccmp(const void *p1, const void *p2)
+{
+	const DCRECORD *r1 = (const DCRECORD *)p1, *r2 = (const DCRECORD *)p2;
+
+	if (r1->dr_dev != r2->dr_dev)
+		return(r1->dr_dev < r2->dr_dev ? -1 : 1);
+	if (r1->dr_ino != r2->dr_ino)
+		return(r1->dr_ino < r2->dr_ino ? -1 : 1);
+	return(0);
+}
+
+static void dcload(const char *path)
+{
+	struct stat cstat;
+	int fd;
+
+	dcpath = path;
+	if ((fd = open(path, O_RDONLY | O_BINARY)) < 0)
+		return;
+	if (fstat(fd, &cstat) || (size_t)cstat.st_size < sizeof(DCHEADER)) {
+		close(fd);
+		return;
+	}
+	dcsize = (size_t)cstat.st_size;
+#ifdef HAVE_SYS_MMAN_H
+	dcmap = mmap(NULL, dcsize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (dcmap == MAP_FAILED)
+		dcmap = NULL;
+#else
+	dcmap = xcharalloc(dcsize);
+	if (read(fd, dcmap, dcsize) != (ssize_t)dcsize) {
+		free(dcmap);
+		dcmap = NULL;
+	}
+#endif
+	close(fd);
+	if (dcmap == NULL)
+		return;
+
+	DCHEADER *dh = (DCHEADER *)dcmap;
+	if (
+		memcmp(dh->dh_magic, DCMAGIC, sizeof(dh->dh_magic)) != 0 ||
+		dh->dh_order != DCORDER ||
+		dh->dh_recsize != sizeof(DCRECORD) ||
+		dh->dh_ndirs > (dcsize - sizeof(DCHEADER)) / sizeof(DCRECORD)
+	) {
+		fprintf(stderr, "Ignoring invalid directory cache %s.\n", path);
+#ifdef HAVE_SYS_MMAN_H
+		munmap(dcmap, dcsize);
+#else
+		free(dcmap);
+#endif
+		dcmap = NULL;
+		return;
+	}
+	dcnrecs = (size_t)dh->dh_ndirs;
+	dcrecs = (DCRECORD *)xnmalloc(dcnrecs, sizeof(DCRECORD));
+	memcpy(dcrecs, dcmap + sizeof(DCHEADER), dcnrecs * sizeof(DCRECORD));
+	qsort(dcrecs, dcnrecs, sizeof(DCRECORD), dcreccmp);
+}
+
+/* Check a cached listing before trusting it, so that a damaged cache
+   causes a rescan rather than a wrong answer. */
+static int dcvalid(const char *map, size_t size, const DCRECORD *r)
+{
+	uint64_t nfils = r->dr_nfils, nameslen = r->dr_nameslen;
+
+	if (
+		r->dr_data % 8 != 0 ||
+		nameslen > UINT32_MAX ||
+		r->dr_data > size ||
+		dclistsize(nfils, nameslen) > size - r->dr_data
+	)
+		return(0);
+	const uint32_t *off = (const uint32_t *)(map + r->dr_data);
+	const unsigned short *len = (const unsigned short *)(off + nfils);
+	const char *names = (const char *)(len + nfils) + nfils;
+	const char *prev = NULL;
+	for (uint64_t i = 0; i < nfils; i++) {
+		if (
+			off[i] >= nameslen ||
+			len[i] >= nameslen - off[i] ||
+			names[off[i] + len[i]] != '\0' ||
+			strlen(names + off[i]) != len[i] ||
+			(prev != NULL && strcmp(prev, names + off[i]) >= 0)
+		)
+			return(0);
+		prev = names + off[i];
+	}
+	return(1);
+}
+
+/* Point di at the listing described by r, used in place. */
+static void dclisting(DIRINFO *di, char *map, const DCRECORD *r)
+{
+	di->di_nfils = r->dr_nfils;
+	di->di_off = (uint32_t *)(map + r->dr_data);
+	di->di_len = (unsigned short *)(di->di_off + di->di_nfils);
+	di->di_type = (unsigned char *)(di->di_len + di->di_nfils);
+	di->di_names = (char *)(di->di_type + di->di_nfils);
+	di->di_nameslen = r->dr_nameslen;
+	di->di_room = 0;
+	di->di_namesroom = 0;
+}
+
+/* Use a cached listing for di if there is an up-to-date one. */
+static int dctake(DIRINFO *di, int sticky)
+{
+	DCRECORD key, *r;
+
+	if (dcrecs == NULL)
+		return(0);
+	key.dr_dev = (uint64_t)di->di_vid;
+	key.dr_ino = (uint64_t)di->di_did;
+	if (
+		(r = bsearch(&key, dcrecs, dcnrecs, sizeof(DCRECORD), dcreccmp)) == NULL ||
+		r->dr_ctime != di->di_ctime.tv_sec ||
+		r->dr_ctimens != di->di_ctime.tv_nsec ||
+		r->dr_mtime != di->di_mtime.tv_sec ||
+		r->dr_mtimens != di->di_mtime.tv_nsec ||
+		!dcvalid(dcmap, dcsize, r)
+	)
+		return(0);
+
+	dclisting(di, dcmap, r);
+	di->di_flags |= DI_CACHEABLE;
+	di->di_pins++;			/* mapped, so nothing to gain by evicting it */
+	dalloc(di, sticky);
+	return(1);
+}
+
+/* Pad after n bytes to keep listings 8-byte aligned. */
+static void dcpad(FILE *fp, uint64_t n)
+{
+	static const char zeros[8];
+
+	if (n % 8 != 0)
+		fwrite(zeros, 1, 8 - n % 8, fp);
+}
+
+/* Has di the times it had when it was read? If the job has changed it, its
+   listing no longer holds and is not to be saved. */
+static int dcunchanged(const DIRINFO *di)
+{
+	struct stat dstat;
+
+	if (
+		di->di_fd >= 0 ? fstat(di->di_fd, &dstat) != 0 :
+		stat(di->di_path, &dstat) != 0 || dstat.st_dev != di->di_vid || dstat.st_ino != di->di_did
+	)
+		return(0);
+	return(
+		get_stat_ctime(&dstat).tv_sec == di->di_ctime.tv_sec &&
+		get_stat_ctime(&dstat).tv_nsec == di->di_ctime.tv_nsec &&
+		get_stat_mtime(&dstat).tv_sec == di->di_mtime.tv_sec &&
+		get_stat_mtime(&dstat).tv_nsec == di->di_mtime.tv_nsec
+	);
+}
+
+/* Save the cacheable listings read in this run, and carry over the
+   listings of any other directories already in the cache. */
+static void dcsave(void)
+{
+	size_t nrecs = 0, nnew;
+	DCRECORD *recs = (DCRECORD *)xnmalloc(ndirs + dcnrecs, sizeof(DCRECORD));
+	DIRINFO **recdirs = (DIRINFO **)xnmalloc(ndirs, sizeof(DIRINFO *));
+
+	for (size_t i = 0; i < ndirs; i++)
+		if ((dirs[i]->di_flags & DI_CACHEABLE) && dcunchanged(dirs[i])) {
+			DCRECORD *r = &recs[nrecs];
+			memset(r, 0, sizeof(DCRECORD));
+			r->dr_dev = (uint64_t)dirs[i]->di_vid;
+			r->dr_ino = (uint64_t)dirs[i]->di_did;
+			r->dr_ctime = dirs[i]->di_ctime.tv_sec;
+			r->dr_ctimens = dirs[i]->di_ctime.tv_nsec;
+			r->dr_mtime = dirs[i]->di_mtime.tv_sec;
+			r->dr_mtimens = dirs[i]->di_mtime.tv_nsec;
+			r->dr_nfils = dirs[i]->di_nfils;
+			r->dr_nameslen = dirs[i]->di_nameslen;
+			recdirs[nrecs++] = dirs[i];
+		}
+	nnew = nrecs;
+	for (size_t i = 0; i < dcnrecs; i++)
+		if (
+			dsearch((dev_t)dcrecs[i].dr_dev, (ino_t)dcrecs[i].dr_ino) == NULL &&
+			dcvalid(dcmap, dcsize, &dcrecs[i])
+		)
+			recs[nrecs++] = dcrecs[i];
+
+	char *tmp = xcharalloc(strlen(dcpath) + sizeof(".XXXXXX"));
+	sprintf(tmp, "%s.XXXXXX", dcpath);
+	int fd = mkstemp(tmp);
+	FILE *fp;
+	if (fd < 0 || (fp = fdopen(fd, "wb")) == NULL) {
+		fprintf(stderr, "Cannot write directory cache %s.\n", dcpath);
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return;
+	}
+
+	DCHEADER dh;
+	memset(&dh, 0, sizeof(DCHEADER));
+	memcpy(dh.dh_magic, DCMAGIC, sizeof(dh.dh_magic));
+	dh.dh_order = DCORDER;
+	dh.dh_recsize = sizeof(DCRECORD);
+	dh.dh_ndirs = nrecs;
+	uint64_t data = sizeof(DCHEADER) + nrecs * sizeof(DCRECORD);
+	uint64_t *olddata = (uint64_t *)xnmalloc(nrecs, sizeof(uint64_t));
+	for (size_t i = 0; i < nrecs; i++) {
+		olddata[i] = recs[i].dr_data;
+		recs[i].dr_data = data;
+		data += dclistsize(recs[i].dr_nfils, recs[i].dr_nameslen);
+	}
+	fwrite(&dh, sizeof(DCHEADER), 1, fp);
+	fwrite(recs, sizeof(DCRECORD), nrecs, fp);
+	for (size_t i = 0; i < nrecs; i++) {
+		size_t nfils = recs[i].dr_nfils;
+		if (i < nnew) {
+			DIRINFO *di = recdirs[i];
+			fwrite(di->di_off, sizeof(uint32_t), nfils, fp);
+			fwrite(di->di_len, sizeof(unsigned short), nfils, fp);
+			fwrite(di->di_type, 1, nfils, fp);
+			fwrite(di->di_names, 1, di->di_nameslen, fp);
+			dcpad(fp, nfils * (sizeof(uint32_t) + sizeof(unsigned short) + 1) +
+				di->di_nameslen);
+		}
+		else
+			fwrite(dcmap + olddata[i], 1,
+				dclistsize(nfils, recs[i].dr_nameslen), fp);
+	}
+	if (ferror(fp) | fclose(fp) || rename(tmp, dcpath)) {
+		fprintf(stderr, "Cannot write directory cache %s.\n", dcpath);
+		unlink(tmp);
+	}
+	free(olddata);
+	free(recdirs);
+	free(recs);
+	free(tmp);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* With --watch, every directory is watched from before it is listed, and
+   one first listed while watching has its plain files held back. */
+static void wadd(DIRINFO *di);
+static void wfresh(DIRINFO *di);
+#endif
+
+/* Find the directory p, which ends at pathend. If at is not NULL, the part
+   of p from atend is a path relative to at. */
+static HANDLE *checkdir(char *p, char *pathend, int makedirs, DIRINFO *at, char *atend)
+{
+	struct stat dstat;
+	ino_t d;
+	dev_t v;
+	DIRINFO *di = NULL;
+	const char *myp, *rel;
+	int atfd = AT_FDCWD;
+	char *lastslash = NULL;
+	int sticky;
+	HANDLE *h;
+
+	if (hsearch(p, &h)) {
+		if (h->h_di == NULL) {
+			direrr = h->h_err;
+			return(NULL);
+		}
+		if (h->h_di->di_flags & DI_EVICTED)
+			dreload(h->h_di);
+		return(h);
+	}
+
+	if (*p == '\0')
+		myp = ".";
+	else if (pathend == p + 1)
+		myp = SLASHSTR;
+	else {
+		lastslash = pathend - 1;
+		*lastslash = '\0';
+		myp = p;
+	}
+	rel = myp;
+	if (at != NULL && !(at->di_flags & DI_NONEXISTENT) && atend < pathend - 1) {
+		atfd = dfd(at);
+		rel = atend;
+	}
+
+	if (fstatat(atfd, rel, &dstat, 0) || (dstat.st_mode & S_IFMT) != S_IFDIR) {
+		if (makedirs) {
+			di = dtrieadd(myp);
+		} else
+			direrr = h->h_err = H_NODIR;
+	} else if (faccessat(atfd, rel, R_OK | X_OK, 0))
+		direrr = h->h_err = H_NOREADDIR;
+	else {
+		direrr = 0;
+		sticky = (dstat.st_mode & S_ISVTX) && uid != 0 && uid != dstat.st_uid ?
+			FI_INSTICKY : 0;
+		v = dstat.st_dev;
+		d = dstat.st_ino;
+
+		if ((di = dsearch(v, d)) == NULL) {
+			di = dadd(v, d);
+			di->di_path = xstrdup(myp);
+			if (modeperm(&dstat, S_IWUSR))
+				di->di_flags |= DI_MODEWRITE;
+			di->di_ctime = get_stat_ctime(&dstat);
+			di->di_mtime = get_stat_mtime(&dstat);
+#ifdef HAVE_SYS_INOTIFY_H
+			if (watchfd >= 0)
+				wadd(di);
+#endif
+			if (!dctake(di, sticky)) {
+				if (dcpath != NULL && di->di_ctime.tv_sec + DCSLACK < time(NULL))
+					di->di_flags |= DI_CACHEABLE;
+				int fd = openat(atfd, rel, O_RDONLY | O_DIRECTORY);
+				if (fd < 0 || fstat(fd, &dstat) || dstat.st_dev != v || dstat.st_ino != d) {
+					fprintf(stderr, "Strange, can't scan %s.\n", myp);
+					quit();
+				}
+				dsetfd(di, fd);
+				takedir(myp, di, sticky);
+			}
+#ifdef HAVE_SYS_INOTIFY_H
+			if (watching)
+				wfresh(di);
+#endif
+		}
+		else if (di->di_flags & DI_EVICTED)
+			dreload(di);
+	}
+
+	if (lastslash != NULL)
+		*lastslash = SLASH;
+	if (direrr != 0)
+		return(NULL);
+	h->h_di = di;
+	return(h);
+}
+
+static int checkto(char *f, HANDLE **phto, char **pnto, FILENO *pfdel)
 {
 	char tpath[PATH_MAX + 1];
-	FILEINFO *fdel = NULL;
+	FILENO fdel = NOFILE;
 
+	*pfdel = NOFILE;
 	char *pathend = getpath(tpath);
 	size_t hlen = (size_t)(pathend - fullrep);
-	*phto = checkdir(tpath, tpath + hlen, mkdirs);
+	*phto = checkdir(tpath, tpath + hlen, mkdirs, NULL, NULL);
 	if (
 	    *phto != NULL &&
 	    *pathend != '\0' &&
-	    (fdel = *pfdel = fsearch(pathend, (*phto)->h_di)) != NULL &&
-	    (getstat(fullrep, fdel), fdel->fi_stflags & FI_ISDIR) &&
+	    (fdel = *pfdel = ftarget(pathend, (*phto)->h_di)) != NOFILE &&
+	    (getstat(fullrep, (*phto)->h_di, fdel),
+	     (*phto)->h_di->di_stflags[fdel] & FI_ISDIR) &&
 	    (strcmp(pathend, fullrep) != 0)
 	    ) {
 		size_t tlen = strlen(pathend);
@@ -774,7 +1779,7 @@ static int checkto(char *f, HANDLE **phto, char **pnto, FILEINFO **pfdel)
 		strcpy(tpath + hlen, pathend);
 		pathend += tlen;
 		hlen += tlen;
-		*phto = checkdir(tpath, tpath + hlen, mkdirs);
+		*phto = checkdir(tpath, tpath + hlen, mkdirs, NULL, NULL);
 	}
 
 	if (*pathend == '\0') {
@@ -785,13 +1790,13 @@ static int checkto(char *f, HANDLE **phto, char **pnto, FILEINFO **pfdel)
 		}
 		strcat(pathend, f);
 		if (*phto != NULL) {
-			fdel = *pfdel = fsearch(f, (*phto)->h_di);
-			if (fdel != NULL)
-				getstat(fullrep, fdel);
+			fdel = *pfdel = ftarget(f, (*phto)->h_di);
+			if (fdel != NOFILE)
+				getstat(fullrep, (*phto)->h_di, fdel);
 		}
 	}
-	else if (fdel != NULL)
-		*pnto = fdel->fi_name;
+	else if (fdel != NOFILE)
+		*pnto = FNAME((*phto)->h_di, fdel);
 	else
 		*pnto = xstrdup(pathend);
 	return(0);
@@ -807,9 +1812,7 @@ static int badname(char *s)
 
 static int dwritable(HANDLE *h)
 {
-	char *p = h->h_name, *lastslash = NULL, *pathend;
-	const char *myp;
-	char *pw = &(h->h_di->di_flags), r;
+	unsigned short *pw = &(h->h_di->di_flags), r;
 
 	if (uid == 0)
 		return(1);
@@ -817,47 +1820,39 @@ static int dwritable(HANDLE *h)
 	if (*pw & DI_KNOWWRITE)
 		return(*pw & DI_CANWRITE);
 
-	pathend = p + strlen(p);
-	if (*p == '\0')
-		myp = ".";
-	else if (pathend == p + 1)
-		myp = SLASHSTR;
-	else {
-		lastslash = pathend - 1;
-		*lastslash = '\0';
-		myp = p;
-	}
-	r = !access(myp, W_OK) ? DI_CANWRITE : 0;
+	if (trustmode(h->h_di))
+		r = (*pw & DI_MODEWRITE) ? DI_CANWRITE : 0;
+	else
+		r = !faccessat(dfd(h->h_di), ".", W_OK, 0) ? DI_CANWRITE : 0;
 	*pw |= DI_KNOWWRITE | r;
-
-	if (lastslash != NULL)
-		*lastslash = SLASH;
 	return(r);
 }
 
-static int fwritable(char *hname, FILEINFO *f)
+static int fwritable(DIRINFO *d, FILENO f)
 {
-	int r;
+	int flags = d->di_stflags[f], r;
 
-	if (f->fi_stflags & FI_KNOWWRITE)
-		return(f->fi_stflags & FI_CANWRITE);
+	if (flags & FI_KNOWWRITE)
+		return(flags & FI_CANWRITE);
 
-	strcpy(fullrep, hname);
-	strcat(fullrep, f->fi_name);
-	r = !access(fullrep, W_OK) ? FI_CANWRITE : 0;
-	f->fi_stflags |= FI_KNOWWRITE | r;
+	if ((flags & FI_STTAKEN) && !(flags & FI_LINKERR) && trustmode(d))
+		r = (flags & FI_MODEWRITE) ? FI_CANWRITE : 0;
+	else
+		r = !faccessat(dfd(d), FNAME(d, f), W_OK, 0) ? FI_CANWRITE : 0;
+	d->di_stflags[f] |= (unsigned short)(FI_KNOWWRITE | r);
 	return(r);
 }
 
-static int badrep(HANDLE *hfrom, FILEINFO *ffrom, HANDLE **phto, char **pnto, FILEINFO **pfdel, int *pflags)
+static int badrep(HANDLE *hfrom, FILENO ffrom, HANDLE **phto, char **pnto, FILENO *pfdel, int *pflags)
 {
-	char *f = ffrom->fi_name;
+	char *f = FNAME(hfrom->h_di, ffrom);
+	int stflags = hfrom->h_di->di_stflags[ffrom];
 
 	*pflags = 0;
-	if ((ffrom->fi_stflags & FI_LINKERR) && !(op & (MOVE | SYMLINK)))
+	if ((stflags & FI_LINKERR) && !(op & (MOVE | SYMLINK)))
 		printf("%s -> %s : source file is a badly aimed symbolic link.\n",
 			pathbuf, fullrep);
-	else if ((op & (COPY | APPEND)) && access(pathbuf, R_OK))
+	else if ((op & (COPY | APPEND)) && !freadable(hfrom->h_di, ffrom))
 		printf("%s -> %s : no read permission for source file.\n",
 			pathbuf, fullrep);
 	else if (
@@ -884,8 +1879,8 @@ static int badrep(HANDLE *hfrom, FILEINFO *ffrom, HANDLE **phto, char **pnto, FI
 			pathbuf, fullrep);
 	else if (
 		*pflags && (op & MOVE) &&
-		!(ffrom->fi_stflags & FI_ISLNK) &&
-		access(pathbuf, R_OK)
+		!(stflags & FI_ISLNK) &&
+		!freadable(hfrom->h_di, ffrom)
 	)
 		printf("%s -> %s : no read permission for source file.\n",
 			pathbuf, fullrep);
@@ -1001,13 +1996,47 @@ toolong:
 	strcpy(fullrep, TOOLONG);
 }
 
-static int dostage(char *lastend, char *pathend, char **start1, size_t *len1, int stage, int anylev)
+static REPNO repadd(REP *p)
+{
+	if (nreptab == reptabroom)
+		reptab = (REP **)x2nrealloc(reptab, &reptabroom, sizeof(REP *));
+	if (nreptab == UINT32_MAX) {
+		fprintf(stderr, "Too many matches.\n");
+		quit();
+	}
+	reptab[nreptab] = p;
+	return((REPNO)nreptab++);
+}
+
+/* With --stream, actions that can be done at once are done by streamrep. */
+static int streamrep(REP *p);
+
+/* With --watch, the first file from f on that is to be matched in this
+   batch. */
+static _GL_ATTRIBUTE_PURE FILENO nextnew(const DIRINFO *di, FILENO f)
+{
+	size_t lo = 0, hi = di->di_nnew;
+
+	if (di->di_nnew == NOFILE)
+		return(f);
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (di->di_new[mid] < f)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return(lo < di->di_nnew ? di->di_new[lo] : di->di_nfils);
+}
+
+static int dostage(char *lastend, char *pathend, char **start1, size_t *len1, int stage, int anylev,
+	int depth, DIRINFO *at, char *atend)
 {
 	DIRINFO *di;
 	HANDLE *h, *hto;
-	size_t prelen, litlen, i, k, nfils;
+	size_t prelen, litlen, k;
+	FILENO i, nfils, fdel = NOFILE;
 	int flags, try;
-	FILEINFO **pf, *fdel = NULL;
 	char *nto, *firstesc;
 	REP *p;
 	int ret = 1, laststage = (stage + 1 == nstages);
@@ -1026,7 +2055,7 @@ static int dostage(char *lastend, char *pathend, char **start1, size_t *len1, in
 		lastend = stagel[stage];
 	}
 
-	if ((h = checkdir(pathbuf, pathend, mkdirs)) == NULL) {
+	if ((h = checkdir(pathbuf, pathend, mkdirs, at, atend)) == NULL) {
 		if (stage == 0 || direrr == H_NOREADDIR) {
 			printf("%s -> %s : directory %s does not %s.\n",
 				from, to, pathbuf, direrr == H_NOREADDIR ?
@@ -1036,6 +2065,7 @@ static int dostage(char *lastend, char *pathend, char **start1, size_t *len1, in
 		return(stage);
 	}
 	di = h->h_di;
+	di->di_pins++;
 
 	if (*lastend == ';') {
 		anylev = 1;
@@ -1057,77 +2087,246 @@ static int dostage(char *lastend, char *pathend, char **start1, size_t *len1, in
 	if (firstesc == NULL || firstesc > firstwild[stage])
 		firstesc = firstwild[stage];
 	litlen = (size_t)(firstesc - lastend);
-	pf = di->di_fils + (i = ffirst(lastend, litlen, di));
+	i = ffirst(lastend, litlen, di);
+	if (watching && laststage)
+		i = nextnew(di, i);
 	if (i < nfils)
 	do {
 		if (
-			(try = trymatch(*pf, lastend)) != 0 &&
+			(try = trymatch(di, i, lastend)) != 0 &&
 			(
 				try == 1 ||
-				match(lastend + litlen, (*pf)->fi_name + litlen,
-					start1 + anylev, len1 + anylev)
+				(stageisre[stage] ?
+				 rematch(stage, FNAME(di, i), start1 + anylev, len1 + anylev) :
+				 match(lastend + litlen, FNAME(di, i) + litlen,
+					start1 + anylev, len1 + anylev))
 			) &&
-			keepmatch(*pf, pathend, &k, 0, laststage)
+			keepmatch(di, i, pathend, &k, 0, laststage)
 		) {
 			if (!laststage)
 				ret &= dostage(stager[stage], pathend + k,
 					start1 + nwilds[stage], len1 + nwilds[stage],
-					stage + 1, 0);
+					stage + 1, 0, 0, di, pathend);
 			else {
 				ret = 0;
-				makerep();
-				if (badrep(h, *pf, &hto, &nto, &fdel, &flags)) {
-					(*pf)->fi_rep = MISTAKE;
-				} else {
-					(*pf)->fi_rep = p = (REP *)xmalloc(sizeof(REP));
-					p->r_flags = flags;
-					p->r_hfrom = h;
-					p->r_ffrom = *pf;
-					p->r_hto = hto;
-					p->r_nto = xstrdup(nto);
-					p->r_fdel = fdel;
-					p->r_first = p;
-					p->r_thendo = NULL;
-					p->r_next = NULL;
-					lastrep->r_next = p;
-					lastrep = p;
-					nreps++;
+				/* With several TO patterns the source's entry refers
+				   to its first good rep. */
+				for (unsigned j = 0; j < ntos; j++) {
+					if (ntos > 1)
+						strcpy(to, tos[j]);
+					makerep();
+					if (badrep(h, i, &hto, &nto, &fdel, &flags)) {
+						if (di->di_rep[i] == NOREP)
+							di->di_rep[i] = MISTAKEREP;
+					} else {
+						p = (REP *)xmalloc(sizeof(REP));
+						p->r_flags = flags;
+						p->r_hfrom = h;
+						p->r_ffrom = i;
+						p->r_hto = hto;
+						p->r_nto = xstrdup(nto);
+						p->r_fdel = fdel;
+						p->r_first = p;
+						p->r_thendo = NULL;
+						p->r_next = NULL;
+						if (stream && streamrep(p)) {
+							if (di->di_rep[i] == NOREP)
+								di->di_rep[i] = STREAMREP;
+							continue;
+						}
+						if (di->di_rep[i] == NOREP || di->di_rep[i] == MISTAKEREP || di->di_rep[i] == STREAMREP)
+							di->di_rep[i] = repadd(p);
+						hto->h_di->di_pins++;
+						lastrep->r_next = p;
+						lastrep = p;
+						nreps++;
+					}
 				}
 			}
 		}
-		i++, pf++;
-	} while (i < nfils && strncmp(lastend, (*pf)->fi_name, litlen) == 0);
+		i = watching && laststage ? nextnew(di, i + 1) : i + 1;
+	} while (i < nfils && strncmp(lastend, FNAME(di, i), litlen) == 0);
 
 skiplev:
-	if (anylev)
-		for (pf = di->di_fils, i = 0; i < nfils; i++, pf++)
+	if (anylev && (maxdepth < 0 || depth < maxdepth))
+		for (i = 0; i < nfils; i++)
 			if (
-				*((*pf)->fi_name) != '.' &&
-				keepmatch(*pf, pathend, &k, 1, 0)
+				*FNAME(di, i) != '.' &&
+				keepmatch(di, i, pathend, &k, 1, 0) &&
+				!excluded(FNAME(di, i))
 			) {
 				*len1 = (size_t)(pathend - *start1) + k;
-				ret &= dostage(lastend, pathend + k, start1, len1, stage, 1);
+				ret &= dostage(lastend, pathend + k, start1, len1,
+					stage, 1, depth + 1, di, pathend);
 			}
 
+	di->di_pins--;
+	if (maxmem != 0)
+		devict(di);
 	return(ret);
 }
 
-static int parsepat(void)
+#define RESPECIAL ".[]()*+?{}|^$\\"
+
+/* Length of the literal prefix of a regular expression, which every
+   matching name must start with. */
+static size_t relitlen(const char *re, const char *end)
 {
-	char *p, *lastname, c;
-	int totwilds, instage;
-#define TRAILESC "%s -> %s : trailing %c is superfluous.\n"
+	const char *p;
 
-	lastname = from;
-	if (from[0] == '~' && from[1] == SLASH) {
-		if ((homelen = strlen(home)) + fromlen > MAXPATLEN) {
-			printf(PATLONG, from);
-			return(-1);
-		}
-		memmove(from + homelen, from + 1, fromlen);
+	for (p = re; p < end; p++)
+		if (*p == '|')
+			return(0);
+	for (p = re; p < end && strchr(RESPECIAL, *p) == NULL; p++)
+		;
+	if (p > re && p < end && strchr("*?{", *p) != NULL)
+		p--;
+	return((size_t)(p - re));
+}
+
+/* Split FROM into stages for -E: each component that contains characters
+   special in an extended regular expression is a stage, and must match the
+   whole of a name. Returns the number of wildcards, or -1 on error. */
+static int parsere(char *lastname)
+{
+	char *p, *q, *re;
+	char buf[MAXPATLEN + 5];
+	int totwilds = 0, instage = 0, anylev;
+
+	nstages = 0;
+	for (p = lastname; ; p = q + 1) {
+		if ((q = strchr(p, SLASH)) == NULL)
+			q = p + strlen(p);
+		anylev = (*p == ';');
+		re = p + anylev;
+		size_t relen = (size_t)(q - re);
+		instage = anylev;
+		if (
+			!(relen == 1 && *re == '.') &&
+			!(relen == 2 && re[0] == '.' && re[1] == '.')
+		)
+			for (char *r = re; r < q; r++)
+				if (strchr(RESPECIAL, *r) != NULL)
+					instage = 1;
+		if (instage) {
+			if (nstages == MAXWILD) {
+				printf("%s -> %s : too many wildcards.\n", from, to);
+				return(-1);
+			}
+			stagel[nstages] = p;
+			stager[nstages] = q;
+			nwilds[nstages] = anylev;
+			stageisre[nstages] = relen > 0 && q > re + relitlen(re, q);
+			if (stageisre[nstages]) {
+				sprintf(buf, "^(%.*s)$", (int)relen, re);
+				int err = regcomp(&stagere[nstages], buf, REG_EXTENDED);
+				if (err != 0) {
+					regerror(err, &stagere[nstages], buf, sizeof(buf));
+					printf("%s -> %s : %s.\n", from, to, buf);
+					return(-1);
+				}
+				nwilds[nstages] += (int)stagere[nstages].re_nsub - 1;
+				firstwild[nstages] = re + relitlen(re, q);
+			}
+			else
+				firstwild[nstages] = q;
+			if ((totwilds += nwilds[nstages]) > MAXWILD) {
+				printf("%s -> %s : too many wildcards.\n", from, to);
+				return(-1);
+			}
+			nstages++;
+		}
+		if (*q == '\0')
+			break;
+	}
+
+	if (!instage) {
+		stagel[nstages] = p;
+		nwilds[nstages] = 0;
+		stageisre[nstages] = false;
+		firstwild[nstages] = q;
+		stager[nstages++] = q;
+	}
+	return(totwilds);
+}
+
+/* Check the TO pattern in to, expanding a leading ~, given the number of
+   wildcards in the FROM pattern. */
+static int parseto(int totwilds)
+{
+	char *p, *lastname, c;
+#define TRAILESC "%s -> %s : trailing %c is superfluous.\n"
+
+	lastname = to;
+	if (to[0] == '~' && to[1] == SLASH) {
+		if ((homelen = strlen(home)) + tolen > MAXPATLEN) {
+			printf(PATLONG, to);
+				return(-1);
+		}
+		memmove(to + homelen, to + 1, tolen);
+		memmove(to, home, homelen);
+		lastname += homelen + 1;
+	}
+
+	for (p = lastname; (c = *p) != '\0'; p++)
+		switch (c) {
+		case SLASH:
+			lastname = p + 1;
+			break;
+		case '#':
+			c = *(++p);
+			if (c == 'l' || c == 'u' || c == 'c') {
+				c = *(++p);
+			}
+			if (!isdigit(c)) {
+				printf("%s -> %s : expected digit (not '%c') after #.\n",
+					from, to, c);
+				return(-1);
+			}
+			int x;
+			for (x = 0; ;x *= 10) {
+				x += c - '0';
+				c = *(p+1);
+				if (!isdigit(c))
+					break;
+				p++;
+			}
+			if (x < 1 || x > totwilds) {
+				printf("%s -> %s : wildcard #%d does not exist.\n",
+					from, to, x);
+				return(-1);
+			}
+			break;
+		case ESC:
+			if ((c = *(++p)) == '\0') {
+				printf(TRAILESC, from, to, ESC);
+				return(-1);
+			}
+		}
+
+	return(0);
+}
+
+static int parsepat(void)
+{
+	char *p, *lastname, c;
+	int totwilds, instage;
+
+	lastname = from;
+	if (from[0] == '~' && from[1] == SLASH) {
+		if ((homelen = strlen(home)) + fromlen > MAXPATLEN) {
+			printf(PATLONG, from);
+			return(-1);
+		}
+		memmove(from + homelen, from + 1, fromlen);
 		memmove(from, home, homelen);
 		lastname += homelen + 1;
 	}
+	if (regexmode) {
+		if ((totwilds = parsere(lastname)) < 0)
+			return(-1);
+		goto topat;
+	}
 	totwilds = nstages = instage = 0;
 	for (p = lastname; (c = *p) != '\0'; p++)
 		switch (c) {
@@ -1202,81 +2401,50 @@ static int parsepat(void)
 		stager[nstages++] = p;
 	}
 
-	lastname = to;
-	if (to[0] == '~' && to[1] == SLASH) {
-		if ((homelen = strlen(home)) + tolen > MAXPATLEN) {
-			printf(PATLONG, to);
-				return(-1);
-		}
-		memmove(to + homelen, to + 1, tolen);
-		memmove(to, home, homelen);
-		lastname += homelen + 1;
+topat:
+	for (unsigned j = 0; j < ntos; j++) {
+		strcpy(to, tos[j]);
+		tolen = strlen(to);
+		if (parseto(totwilds))
+			return(-1);
+		tos[j] = xstrdup(to);
 	}
-
-	for (p = lastname; (c = *p) != '\0'; p++)
-		switch (c) {
-		case SLASH:
-			lastname = p + 1;
-			break;
-		case '#':
-			c = *(++p);
-			if (c == 'l' || c == 'u' || c == 'c') {
-				c = *(++p);
-			}
-			if (!isdigit(c)) {
-				printf("%s -> %s : expected digit (not '%c') after #.\n",
-					from, to, c);
-				return(-1);
-			}
-			int x;
-			for (x = 0; ;x *= 10) {
-				x += c - '0';
-				c = *(p+1);
-				if (!isdigit(c))
-					break;
-				p++;
-			}
-			if (x < 1 || x > totwilds) {
-				printf("%s -> %s : wildcard #%d does not exist.\n",
-					from, to, x);
-				return(-1);
-			}
-			break;
-		case ESC:
-			if ((c = *(++p)) == '\0') {
-				printf(TRAILESC, from, to, ESC);
-				return(-1);
-			}
-		}
-
+	strcpy(to, tos[0]);
 	return(0);
 }
 
-static void matchpat(void)
+/* Return 1 if the patterns are bad. */
+static int matchpat(void)
 {
-	if (parsepat())
+	if (parsepat()) {
 		paterr = 1;
-	else if (dostage(from, pathbuf, start, length, 0, 0)) {
+		return(1);
+	}
+	if (dostage(from, pathbuf, start, length, 0, 0, 0, NULL, NULL)) {
 		printf("%s -> %s : no match.\n", from, to);
 		paterr = 1;
 	}
+	return(0);
 }
 
-static void domatch(char *cfrom, char *cto)
+static int domatch(char *cfrom, char **ctos, unsigned n)
 {
 	if ((fromlen = strlen(cfrom)) >= MAXPATLEN) {
 		printf(PATLONG, cfrom);
 		paterr = 1;
+		return(1);
 	}
-	else if ((tolen = strlen(cto)) >= MAXPATLEN) {
-		printf(PATLONG, cto);
-		paterr = 1;
-	}
-	else {
-		strcpy(from, cfrom);
-		strcpy(to, cto);
-		matchpat();
-	}
+	for (unsigned i = 0; i < n; i++)
+		if (strlen(ctos[i]) >= MAXPATLEN) {
+			printf(PATLONG, ctos[i]);
+			paterr = 1;
+			return(1);
+		}
+	strcpy(from, cfrom);
+	strcpy(to, ctos[0]);
+	tos = ctos;
+	ntos = n;
+	return(matchpat());
 }
 
 static int rdcmp(const void *p1, const void *p2)
@@ -1293,6 +2461,174 @@ static int rdcmp(const void *p1, const void *p2)
 	return(ret);
 }
 
+static void rdskip(const REPDICT *prd)
+{
+	prd->rd_p->r_flags |= R_SKIP;
+	repdrop(prd->rd_p);
+	nreps--;
+	badreps++;
+}
+
+/* Check prd, given the entry after it in order, or NULL. */
+static void rdcheck(const REPDICT *prd, const REPDICT *next, unsigned *pmult)
+{
+	if (
+		next != NULL &&
+		prd->rd_dto == next->rd_dto &&
+		strcmp(prd->rd_nto, next->rd_nto) == 0
+	) {
+		if (!*pmult)
+			*pmult = 1;
+		else
+			printf(" , ");
+		printf("%s%s", prd->rd_p->r_hfrom->h_name,
+			FNAME(prd->rd_p->r_hfrom->h_di, prd->rd_p->r_ffrom));
+		rdskip(prd);
+	}
+	else if (*pmult) {
+		rdskip(prd);
+		printf(" , %s%s -> %s%s : collision.\n",
+			prd->rd_p->r_hfrom->h_name,
+			FNAME(prd->rd_p->r_hfrom->h_di, prd->rd_p->r_ffrom),
+			prd->rd_p->r_hto->h_name, prd->rd_nto);
+		*pmult = 0;
+	}
+}
+
+/* With --max-memory, if the entries for all the actions would take more
+   than the budget, they are sorted in runs that fit, each written to a
+   temporary file, and the runs are merged through a heap holding one entry
+   from each. The files hold pointers, as they never outlive the process.
+   However small the budget, runs are only made longer than it to keep
+   their number down to RUNMAX, so that even a small job can be spilled. */
+
+#define RUNMAX 256		/* runs, each with a file open */
+
+typedef struct {
+	REP *xr_p;
+	DIRINFO *xr_dto;
+	unsigned xr_i;
+	uint32_t xr_len;		/* of the name that follows, with its NUL */
+} XREC;
+
+typedef struct {
+	FILE *ru_fp;
+	REPDICT ru_rd;			/* next entry */
+	char *ru_name;
+} RUN;
+
+static int runread(RUN *ru)
+{
+	XREC x;
+
+	if (fread(&x, sizeof(x), 1, ru->ru_fp) != 1)
+		return(0);
+	if (x.xr_len > PATH_MAX + 1 || fread(ru->ru_name, 1, x.xr_len, ru->ru_fp) != x.xr_len) {
+		fprintf(stderr, "Strange, couldn't read back a sort run.\n");
+		quit();
+	}
+	ru->ru_rd.rd_p = x.xr_p;
+	ru->ru_rd.rd_dto = x.xr_dto;
+	ru->ru_rd.rd_nto = ru->ru_name;
+	ru->ru_rd.rd_i = x.xr_i;
+	return(1);
+}
+
+static void runsift(RUN **heap, size_t n, size_t i)
+{
+	for (size_t c; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && rdcmp(&heap[c + 1]->ru_rd, &heap[c]->ru_rd) < 0)
+			c++;
+		if (rdcmp(&heap[c]->ru_rd, &heap[i]->ru_rd) >= 0)
+			break;
+		RUN *t = heap[i];
+		heap[i] = heap[c];
+		heap[c] = t;
+	}
+}
+
+/* Take the least entry from the runs into rd, copying its name to name. */
+static int runpop(RUN **heap, size_t *pn, REPDICT *rd, char *name)
+{
+	if (*pn == 0)
+		return(0);
+	RUN *ru = heap[0];
+	*rd = ru->ru_rd;
+	strcpy(name, ru->ru_name);
+	rd->rd_nto = name;
+	if (!runread(ru))
+		heap[0] = heap[--*pn];
+	runsift(heap, *pn, 0);
+	return(1);
+}
+
+static void spillcollisions(size_t per)
+{
+	size_t nruns = (nreps + per - 1) / per, nheap = 0;
+	RUN *runs = (RUN *)xnmalloc(nruns, sizeof(RUN));
+	RUN **heap = (RUN **)xnmalloc(nruns, sizeof(RUN *));
+	REPDICT *rd = (REPDICT *)xnmalloc(per, sizeof(REPDICT));
+	REP *p = hrep.r_next;
+	unsigned i = 0, mult = 0;
+
+	for (size_t k = 0; k < nruns; k++) {
+		size_t n;
+		for (n = 0; n < per && p != NULL; n++, p = p->r_next, i++) {
+			rd[n].rd_p = p;
+			rd[n].rd_dto = p->r_hto->h_di;
+			rd[n].rd_nto = p->r_nto;
+			rd[n].rd_i = i;
+		}
+		qsort(rd, n, sizeof(REPDICT), rdcmp);
+		FILE *fp = runs[k].ru_fp = tmpfile();
+		if (fp == NULL) {
+			fprintf(stderr, "Strange, can't make a temporary file: %s.\n", strerror(errno));
+			quit();
+		}
+		for (size_t j = 0; j < n; j++) {
+			XREC x;
+			memset(&x, 0, sizeof(x));
+			x.xr_p = rd[j].rd_p;
+			x.xr_dto = rd[j].rd_dto;
+			x.xr_i = rd[j].rd_i;
+			x.xr_len = (uint32_t)strlen(rd[j].rd_nto) + 1;
+			fwrite(&x, sizeof(x), 1, fp);
+			fwrite(rd[j].rd_nto, 1, x.xr_len, fp);
+		}
+		if (fflush(fp) || ferror(fp)) {
+			fprintf(stderr, "Strange, can't write a sort run: %s.\n", strerror(errno));
+			quit();
+		}
+		rewind(fp);
+		runs[k].ru_name = xcharalloc(PATH_MAX + 1);
+		if (runread(&runs[k]))
+			heap[nheap++] = &runs[k];
+	}
+	free(rd);
+	for (size_t j = nheap / 2; j-- > 0; )
+		runsift(heap, nheap, j);
+
+	REPDICT rds[2];
+	char *names[2] = { xcharalloc(PATH_MAX + 1), xcharalloc(PATH_MAX + 1) };
+	int c = 0;
+	if (runpop(heap, &nheap, &rds[0], names[0]))
+		for (;;) {
+			int more = runpop(heap, &nheap, &rds[1 - c], names[1 - c]);
+			rdcheck(&rds[c], more ? &rds[1 - c] : NULL, &mult);
+			if (!more)
+				break;
+			c = 1 - c;
+		}
+	free(names[0]);
+	free(names[1]);
+	for (size_t k = 0; k < nruns; k++) {
+		fclose(runs[k].ru_fp);
+		free(runs[k].ru_name);
+	}
+	free(heap);
+	free(runs);
+}
+
 static void checkcollisions(void)
 {
 	REPDICT *rd, *prd;
@@ -1301,6 +2637,11 @@ static void checkcollisions(void)
 
 	if (nreps == 0)
 		return;
+	if (maxmem != 0 && nreps > maxmem / sizeof(REPDICT)) {
+		size_t per = maxmem / sizeof(REPDICT), least = (nreps + RUNMAX - 1) / RUNMAX;
+		spillcollisions(per < least ? least : per);
+		return;
+	}
 	rd = (REPDICT *)xmalloc(nreps * sizeof(REPDICT));
 	for (
 		q = &hrep, p = q->r_next, prd = rd, i = 0;
@@ -1315,38 +2656,13 @@ static void checkcollisions(void)
 	qsort(rd, nreps, sizeof(REPDICT), rdcmp);
 	unsigned mult = 0;
 	for (i = 0, prd = rd, oldnreps = nreps; i < oldnreps; i++, prd++)
-		if (
-			i < oldnreps - 1 &&
-			prd->rd_dto == (prd + 1)->rd_dto &&
-			strcmp(prd->rd_nto, (prd + 1)->rd_nto) == 0
-		) {
-			if (!mult)
-				mult = 1;
-			else
-				printf(" , ");
-			printf("%s%s", prd->rd_p->r_hfrom->h_name,
-				prd->rd_p->r_ffrom->fi_name);
-			prd->rd_p->r_flags |= R_SKIP;
-			prd->rd_p->r_ffrom->fi_rep = MISTAKE;
-			nreps--;
-			badreps++;
-		}
-		else if (mult) {
-			prd->rd_p->r_flags |= R_SKIP;
-			prd->rd_p->r_ffrom->fi_rep = MISTAKE;
-			nreps--;
-			badreps++;
-			printf(" , %s%s -> %s%s : collision.\n",
-				prd->rd_p->r_hfrom->h_name, prd->rd_p->r_ffrom->fi_name,
-				prd->rd_p->r_hto->h_name, prd->rd_nto);
-			mult = 0;
-		}
+		rdcheck(prd, i < oldnreps - 1 ? prd + 1 : NULL, &mult);
+	free(rd);
 }
 
 static void findorder(void)
 {
 	REP *first, *pred;
-	FILEINFO *fi;
 
 	for (REP *q = &hrep, *p = q->r_next; p != NULL; q = p, p = p->r_next)
 		if (p->r_flags & R_SKIP) {
@@ -1354,20 +2670,24 @@ static void findorder(void)
 			p = q;
 		}
 		else if (
-			(fi = p->r_fdel) == NULL ||
-			(pred = fi->fi_rep) == NULL ||
+			p->r_fdel == NOFILE ||
+			(pred = FREP(p->r_hto->h_di, p->r_fdel)) == NULL ||
 			pred == MISTAKE
-		)
+		) {
+			/* Moved away by --stream after p was matched. */
+			if (p->r_fdel != NOFILE && (p->r_hto->h_di->di_stflags[p->r_fdel] & FI_GONE))
+				p->r_fdel = NOFILE;
 			continue;
+		}
 		else if ((first = pred->r_first) == p) {
 			p->r_flags |= R_ISCYCLE;
 			pred->r_flags |= R_ISALIASED;
 			if (op & MOVE)
-				p->r_fdel = NULL;
+				p->r_fdel = NOFILE;
 		}
 		else {
 			if (op & MOVE)
-				p->r_fdel = NULL;
+				p->r_fdel = NOFILE;
 			while (pred->r_thendo != NULL)
 				pred = pred->r_thendo;
 			pred->r_thendo = p;
@@ -1378,13 +2698,144 @@ static void findorder(void)
 		}
 }
 
+/* Whole-directory moves
+
+   With --dir-rename, when every entry of a source directory is to be moved
+   under its own name into one target directory that is empty or yet to be
+   made, on the same device, and no other action involves either directory
+   or anything below them, the moves are marked R_DIRMOVE and kept together,
+   so that doreps can do them by renaming the directory itself. */
+
+static _GL_ATTRIBUTE_PURE int isdots(const char *name)
+{
+	return(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')));
+}
+
+static _GL_ATTRIBUTE_PURE int below(const DIRINFO *d, const DIRINFO *top)
+{
+	size_t n = strlen(top->di_path);
+
+	return(
+		d == top ||
+		(d->di_path != NULL && strncmp(d->di_path, top->di_path, n) == 0 &&
+		 d->di_path[n] == SLASH)
+	);
+}
+
+/* Can d be made again as it is, once it has been renamed? */
+static int remakeable(DIRINFO *d, const struct stat *st)
+{
+	if (uid != 0) {
+		int ingroup = st->st_gid == gid;
+		for (int i = 0; !ingroup && i < nsupgroups; i++)
+			ingroup = st->st_gid == supgroups[i];
+		if (st->st_uid != uid || !ingroup)
+			return(0);
+	}
+#ifdef HAVE_SYS_XATTR_H
+	/* ACLs and other attributes would not be made again, apart from those
+	   of security modules, which the system sets for a new directory. */
+	int fd = dfd(d);
+	ssize_t n = flistxattr(fd, NULL, 0);
+	if (n < 0)
+		return(errno == ENOTSUP);
+	if (n > 0) {
+		char *names = xcharalloc((size_t)n);
+		ssize_t m = flistxattr(fd, names, (size_t)n);
+		int ok = m >= 0;
+		for (ssize_t i = 0; ok && i < m; i += (ssize_t)strlen(names + i) + 1)
+			ok = strncmp(names + i, "security.", STRLEN("security.")) == 0;
+		free(names);
+		return(ok);
+	}
+#endif
+	return(1);
+}
+
+static int wholedir(DIRINFO *d, DIRINFO *t)
+{
+	struct stat dstat;
+	const DIRINFO *e;
+	const char *base;
+	unsigned n = 0;
+
+	if (d->di_path == NULL || t->di_path == NULL || d == t)
+		return(0);
+	base = strrchr(d->di_path, SLASH);
+	base = base == NULL ? d->di_path : base + 1;
+	if (*base == '\0' || isdots(base))
+		return(0);
+	/* Renaming over an empty directory would replace it, owner and all. */
+	if (!(t->di_flags & DI_NONEXISTENT))
+		return(0);
+	for (e = t; e != NULL && (e->di_flags & DI_NONEXISTENT); e = e->di_parent)
+		;
+	if (e == NULL || e->di_vid != d->di_vid || below(t, d) || below(d, t))
+		return(0);
+
+	for (FILENO i = 0; i < d->di_nfils; i++) {
+		char *name = FNAME(d, i);
+		REP *p = FREP(d, i);
+		if (isdots(name))
+			continue;
+		if (
+			p == NULL || p == MISTAKE || p->r_hto->h_di != t ||
+			strcmp(p->r_nto, name) != 0 || p->r_first != p ||
+			p->r_thendo != NULL || (p->r_flags & (R_ISCYCLE | R_ISALIASED))
+		)
+			return(0);
+		n++;
+	}
+	for (REP *first = hrep.r_next; first != NULL; first = first->r_next)
+		for (REP *p = first; p != NULL; p = p->r_thendo)
+			if (p->r_hfrom->h_di == d && p->r_thendo == NULL && p == first)
+				n--;
+			else if (
+				below(p->r_hfrom->h_di, d) || below(p->r_hfrom->h_di, t) ||
+				below(p->r_hto->h_di, d) || below(p->r_hto->h_di, t)
+			)
+				return(0);
+	return(n == 0 && fstat(dfd(d), &dstat) == 0 && remakeable(d, &dstat));
+}
+
+static void dirmoves(void)
+{
+	for (REP *p = hrep.r_next; p != NULL; p = p->r_next) {
+		DIRINFO *d = p->r_hfrom->h_di;
+		if ((p->r_flags & R_DIRMOVE) || (d->di_flags & DI_NOTWHOLE))
+			continue;
+		/* The answer is the same for every move from d. */
+		if (!wholedir(d, p->r_hto->h_di)) {
+			d->di_flags |= DI_NOTWHOLE;
+			continue;
+		}
+		/* Gather the directory's moves after p. */
+		REP *q = p, *tail = p, *r;
+		p->r_flags |= R_DIRMOVE;
+		while ((r = q->r_next) != NULL)
+			if (r->r_hfrom->h_di != d)
+				q = r;
+			else {
+				r->r_flags |= R_DIRMOVE;
+				if (q == tail)
+					q = r;
+				else {
+					q->r_next = r->r_next;
+					r->r_next = tail->r_next;
+					tail->r_next = r;
+				}
+				tail = r;
+			}
+	}
+}
+
 static void scandeletes(int (*pkilldel)(REP *))
 {
 	for (REP *q = &hrep, *p = q->r_next; p != NULL; q = p, p = p->r_next) {
-		if (p->r_fdel != NULL)
+		if (p->r_fdel != NOFILE)
 			while ((*pkilldel)(p)) {
 				nreps--;
-				p->r_ffrom->fi_rep = MISTAKE;
+				repdrop(p);
 				REP *n;
 				if ((n = p->r_thendo) != NULL) {
 					if (op & MOVE)
@@ -1404,32 +2855,34 @@ static void scandeletes(int (*pkilldel)(REP *))
 static int baddel(REP *p)
 {
 	HANDLE *hfrom = p->r_hfrom, *hto = p->r_hto;
-	FILEINFO *fto = p->r_fdel;
-	char *t = fto->fi_name, *f = p->r_ffrom->fi_name;
+	DIRINFO *dto = hto->h_di;
+	FILENO fto = p->r_fdel;
+	int stflags = dto->di_stflags[fto];
+	char *t = FNAME(dto, fto), *f = FNAME(hfrom->h_di, p->r_ffrom);
 	char *hnf = hfrom->h_name, *hnt = hto->h_name;
 
 	if (delstyle == NODEL && !(p->r_flags & R_DELOK) && !(op & APPEND))
 		printf("%s%s -> %s%s : old %s%s would have to be %s.\n",
 			hnf, f, hnt, t, hnt, t,
 			(op & OVERWRITE) ? "overwritten" : "deleted");
-	else if (fto->fi_rep == MISTAKE)
+	else if (FREP(dto, fto) == MISTAKE)
 		printf("%s%s -> %s%s : old %s%s was to be done first.\n",
 			hnf, f, hnt, t, hnt, t);
 	else if (
-		fto->fi_stflags & FI_ISDIR
+		stflags & FI_ISDIR
 	)
 		printf("%s%s -> %s%s : %s%s%s is a directory.\n",
 		       hnf, f, hnt, t, (op & APPEND) ? "" : "old ", hnt, t);
-	else if ((fto->fi_stflags & FI_NODEL) && !(op & (APPEND | OVERWRITE)))
+	else if ((stflags & FI_NODEL) && !(op & (APPEND | OVERWRITE)))
 		printf("%s%s -> %s%s : old %s%s lacks delete permission.\n",
 			hnf, f, hnt, t, hnt, t);
 	else if (
 		(op & (APPEND | OVERWRITE)) &&
-		!fwritable(hnt, fto)
+		!fwritable(dto, fto)
 	) {
 		printf("%s%s -> %s%s : %s%s %s.\n",
 			hnf, f, hnt, t, hnt, t,
-			fto->fi_stflags & FI_LINKERR ?
+			stflags & FI_LINKERR ?
 			"is a badly aimed symbolic link" :
 			"lacks write permission");
 	}
@@ -1444,11 +2897,11 @@ static int skipdel(REP *p)
 	if (p->r_flags & R_DELOK)
 		return(0);
 	fprintf(stderr, "%s%s -> %s%s : ",
-		p->r_hfrom->h_name, p->r_ffrom->fi_name,
+		p->r_hfrom->h_name, FNAME(p->r_hfrom->h_di, p->r_ffrom),
 		p->r_hto->h_name, p->r_nto);
 	if (
-		!(p->r_ffrom->fi_stflags & FI_ISLNK) &&
-		!fwritable(p->r_hto->h_name, p->r_fdel)
+		!(p->r_hfrom->h_di->di_stflags[p->r_ffrom] & FI_ISLNK) &&
+		!fwritable(p->r_hto->h_di, p->r_fdel)
 	)
 		fprintf(stderr, "old %s%s lacks write permission. delete it",
 			p->r_hto->h_name, p->r_nto);
@@ -1460,18 +2913,942 @@ static int skipdel(REP *p)
 	return(!getreply());
 }
 
-static void showdone(REP *fin)
-{
-	for (REP *first = hrep.r_next; ; first = first->r_next)
-		for (REP *p = first; p != NULL; p = p->r_thendo) {
-			if (p == fin)
+/* Sharding
+
+   With --shard i/N, only the chains assigned to shard i of N are done, so
+   that one job can be split between processes that see the same files.
+   Every shard matches and checks the whole job, so actions in different
+   shards cannot collide. A chain is assigned by a hash of the full path of
+   the source of its first action, so it is kept whole, and the assignment
+   does not depend on the process, host or byte order. */
+
+static _GL_ATTRIBUTE_PURE uint64_t fnv1a(uint64_t h, const char *s)
+{
+	while (*s != '\0')
+		h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+	return(h);
+}
+
+static _GL_ATTRIBUTE_PURE int inshard(const REP *p)
+{
+	uint64_t h = fnv1a(0xcbf29ce484222325ULL, p->r_hfrom->h_name);
+
+	h = fnv1a(h, FNAME(p->r_hfrom->h_di, p->r_ffrom));
+	return(h % shardn == shardi);
+}
+
+static void shard(void)
+{
+	for (REP *q = &hrep, *p = q->r_next; p != NULL; q = p, p = p->r_next) {
+		if (!inshard(p)) {
+			for (REP *t = p; t != NULL; t = t->r_thendo)
+				nreps--;
+			q->r_next = p->r_next;
+			p = q;
+		}
+	}
+}
+
+/* Scheduling
+
+   With --schedule, chains are reordered before they are done, so that
+   actions on the same directories are done together: by target directory,
+   then source directory, then the position of the source on disk (its
+   first extent when its data is to be read, and otherwise its inode).
+   Whole chains are moved, so the order within a chain, on which chains and
+   cycles rely, is kept; and appends to the same target keep their order.
+   With several TO patterns, the source comes first instead, so that the
+   copies of each source stay together to be fanned out. */
+
+typedef struct {
+	REP *ck_p;
+	int ck_byino;			/* ck_pos is an inode, not an offset */
+	uint64_t ck_pos;
+	size_t ck_seq;			/* original position */
+} CHAINKEY;
+
+static int dircmp(const DIRINFO *d1, const DIRINFO *d2)
+{
+	if (d1->di_vid != d2->di_vid)
+		return(d1->di_vid < d2->di_vid ? -1 : 1);
+	if (d1->di_did != d2->di_did)
+		return(d1->di_did < d2->di_did ? -1 : 1);
+	return(strcmp(d1->di_path, d2->di_path));
+}
+
+static int chaincmp(const void *p1, const void *p2)
+{
+	const CHAINKEY *k1 = (const CHAINKEY *)p1, *k2 = (const CHAINKEY *)p2;
+	const REP *r1 = k1->ck_p, *r2 = k2->ck_p;
+	int res;
+
+	if (ntos > 1) {
+		if ((res = dircmp(r1->r_hfrom->h_di, r2->r_hfrom->h_di)) != 0)
+			return(res);
+		if (k1->ck_byino != k2->ck_byino)
+			return(k1->ck_byino - k2->ck_byino);
+		if (k1->ck_pos != k2->ck_pos)
+			return(k1->ck_pos < k2->ck_pos ? -1 : 1);
+		if (r1->r_ffrom != r2->r_ffrom)
+			return(r1->r_ffrom < r2->r_ffrom ? -1 : 1);
+	}
+	if ((res = dircmp(r1->r_hto->h_di, r2->r_hto->h_di)) != 0)
+		return(res);
+	if (op & APPEND) {
+		if ((res = strcmp(r1->r_nto, r2->r_nto)) != 0)
+			return(res);
+	}
+	else {
+		if ((res = dircmp(r1->r_hfrom->h_di, r2->r_hfrom->h_di)) != 0)
+			return(res);
+		if (k1->ck_byino != k2->ck_byino)
+			return(k1->ck_byino - k2->ck_byino);
+		if (k1->ck_pos != k2->ck_pos)
+			return(k1->ck_pos < k2->ck_pos ? -1 : 1);
+	}
+	return((k1->ck_seq > k2->ck_seq) - (k1->ck_seq < k2->ck_seq));
+}
+
+static void srcpos(CHAINKEY *k)
+{
+	REP *p = k->ck_p;
+	DIRINFO *d = p->r_hfrom->h_di;
+	const char *name = FNAME(d, p->r_ffrom);
+	int fd = dfd(d);
+	struct stat fstat;
+
+#ifdef HAVE_LINUX_FIEMAP_H
+	if (
+		(op & (COPY | APPEND)) ||
+		((op & XMOVE) && p->r_hto->h_di->di_vid != d->di_vid)
+	) {
+		uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t) + 1];
+		struct fiemap *fm = (struct fiemap *)buf;
+		int f = openat(fd, name, O_RDONLY);
+
+		memset(buf, 0, sizeof(buf));
+		fm->fm_length = FIEMAP_MAX_OFFSET;
+		fm->fm_extent_count = 1;
+		if (f >= 0) {
+			int ok = ioctl(f, FS_IOC_FIEMAP, fm) == 0 && fm->fm_mapped_extents > 0 &&
+				!(fm->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN);
+			close(f);
+			if (ok) {
+				k->ck_byino = 0;
+				k->ck_pos = fm->fm_extents[0].fe_physical;
 				return;
+			}
+		}
+	}
+#endif
+	k->ck_byino = 1;
+	k->ck_pos = fstatat(fd, name, &fstat, AT_SYMLINK_NOFOLLOW) ?
+		UINT64_MAX : (uint64_t)fstat.st_ino;
+}
+
+static void schedule(void)
+{
+	size_t n = 0, i;
+	REP *p;
+
+	for (p = hrep.r_next; p != NULL; p = p->r_next)
+		n++;
+	if (n < 2)
+		return;
+
+	CHAINKEY *keys = (CHAINKEY *)xnmalloc(n, sizeof(CHAINKEY));
+	for (p = hrep.r_next, i = 0; p != NULL; p = p->r_next, i++) {
+		keys[i].ck_p = p;
+		keys[i].ck_seq = i;
+		if (!(op & APPEND))
+			srcpos(&keys[i]);
+	}
+	qsort(keys, n, sizeof(CHAINKEY), chaincmp);
+	for (p = &hrep, i = 0; i < n; i++)
+		p = p->r_next = keys[i].ck_p;
+	p->r_next = NULL;
+	free(keys);
+}
+
+/* Journal
+
+   With --journal FILE, the final plan is written to FILE before anything
+   is done: a header, then a record per action, in the order in which they
+   are to be done, giving its source and target and the source's device and
+   inode. As actions are done, markers giving how many have been done are
+   appended and synced, every JBATCH actions or JSECS seconds; appends,
+   which cannot safely be done twice, are marked one at a time. Before the
+   first file of a cycle is moved to its temporary name, a marker giving
+   the name is synced, and before an append cycle starts, one giving the
+   length to append.
+
+   --resume FILE reads the plan back, without matching any patterns. The
+   actions marked done are dropped, as are any done after the last marker,
+   which are recognised from the files themselves: a move is done if its
+   source has gone or been replaced, and a copy or link if its target, which
+   did not exist, now does. The rest are recorded in FILE as a new plan and
+   carried on with. */
+
+#define JMAGIC "mmvjrnl1"
+#define JBATCH 1024
+#define JSECS 1
+
+#define J_CHAIN 0x10000		/* first action of a chain */
+#define J_FDEL 0x20000		/* target to be deleted */
+
+typedef struct {
+	char jh_magic[8];
+	int32_t jh_op, jh_mkdirs;
+	uint32_t jh_nrecs;
+} JHEAD;
+
+/* Followed by the source directory and name and the target directory
+   and name, each with its NUL. */
+typedef struct {
+	uint32_t jr_flags;
+	uint32_t jr_len[4];
+	uint64_t jr_dev, jr_ino;	/* of the source */
+} JREC;
+
+typedef struct {
+	uint32_t jm_type;
+	uint32_t jm_index;
+	int64_t jm_value;
+} JMARK;
+
+#define JM_DONE 1		/* jm_index actions are done */
+#define JM_ALIAS 2		/* the cycle starting at jm_index uses temporary jm_value */
+#define JM_ALIASLEN 3	/* the append cycle starting at jm_index appends jm_value */
+
+static FILE *jfile = NULL;
+static const char *jpath;
+static REP *jchain, *jp;		/* first action not known to be done */
+static unsigned jdone = 0, jmarked = 0, jbatch = JBATCH;
+static struct timespec jlast;
+static REP *jcycle = NULL;		/* resumed chain whose cycle has been started */
+static int jalias = 0;
+static long jaliaslen = 0;
+
+static void jsync(void)
+{
+	if (jfile == NULL)
+		return;
+	if (fflush(jfile) || fdatasync(fileno(jfile))) {
+		fprintf(stderr, "Strange, couldn't write journal %s; carrying on without it.\n",
+			jpath);
+		fclose(jfile);
+		jfile = NULL;
+	}
+	else
+		clock_gettime(CLOCK_MONOTONIC, &jlast);
+}
+
+static void jmark(uint32_t type, unsigned index, int64_t value)
+{
+	JMARK m;
+
+	if (jfile == NULL)
+		return;
+	memset(&m, 0, sizeof(m));
+	m.jm_type = type;
+	m.jm_index = index;
+	m.jm_value = value;
+	fwrite(&m, sizeof(m), 1, jfile);
+}
+
+/* Record how many actions have been done, if enough have since the last
+   time, or anyway if force is set. */
+static void jprogress(int force)
+{
+	struct timespec now;
+
+	if (jfile == NULL)
+		return;
+	for (; jp != NULL && (jp->r_flags & R_DONE); jdone++)
+		if ((jp = jp->r_thendo) == NULL && (jchain = jchain->r_next) != NULL)
+			jp = jchain;
+	if (jdone == jmarked)
+		return;
+	if (!force && jdone - jmarked < jbatch) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - jlast.tv_sec < JSECS)
+			return;
+	}
+	jmark(JM_DONE, jdone, 0);
+	jsync();
+	jmarked = jdone;
+}
+
+/* Record, before it is used, how the cycle starting at action k is done. */
+static void jnote(uint32_t type, unsigned k, int64_t value)
+{
+	if (jfile == NULL)
+		return;
+	jprogress(1);
+	jmark(type, k, value);
+	jsync();
+}
+
+static void jstart(const char *path)
+{
+	char *tpath = xcharalloc(strlen(path) + 5);
+	JHEAD h;
+	unsigned k = 0, kcycle = 0;
+
+	jpath = path;
+	sprintf(tpath, "%s.new", path);
+	if ((jfile = fopen(tpath, "wb")) == NULL) {
+		fprintf(stderr, "%s : %s.\n", tpath, strerror(errno));
+		quit();
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.jh_magic, JMAGIC, sizeof(h.jh_magic));
+	h.jh_op = op;
+	h.jh_mkdirs = mkdirs;
+	h.jh_nrecs = nreps;
+	fwrite(&h, sizeof(h), 1, jfile);
+	for (REP *first = hrep.r_next; first != NULL; first = first->r_next)
+		for (REP *p = first; p != NULL; p = p->r_thendo, k++) {
+			const char *str[4] = {
+				p->r_hfrom->h_name, FNAME(p->r_hfrom->h_di, p->r_ffrom),
+				p->r_hto->h_name, p->r_nto
+			};
+			struct stat sstat;
+			JREC r;
+			memset(&r, 0, sizeof(r));
+			r.jr_flags = (uint32_t)(p->r_flags & (R_ISALIASED | R_ISCYCLE | R_ONEDIRLINK)) |
+				(p == first ? J_CHAIN : 0) | (p->r_fdel != NOFILE ? J_FDEL : 0);
+			for (int i = 0; i < 4; i++)
+				r.jr_len[i] = (uint32_t)strlen(str[i]) + 1;
+			if (fstatat(dfd(p->r_hfrom->h_di), str[1], &sstat, AT_SYMLINK_NOFOLLOW) == 0) {
+				r.jr_dev = (uint64_t)sstat.st_dev;
+				r.jr_ino = (uint64_t)sstat.st_ino;
+			}
+			fwrite(&r, sizeof(r), 1, jfile);
+			for (int i = 0; i < 4; i++)
+				fwrite(str[i], 1, r.jr_len[i], jfile);
+			if (p == jcycle)
+				kcycle = k;
+		}
+	if (jcycle != NULL)
+		jmark((op & APPEND) ? JM_ALIASLEN : JM_ALIAS, kcycle,
+			(op & APPEND) ? jaliaslen : jalias);
+	if (fflush(jfile) || fdatasync(fileno(jfile)) || rename(tpath, path)) {
+		fprintf(stderr, "%s : %s.\n", path, strerror(errno));
+		quit();
+	}
+	free(tpath);
+	if (op & APPEND)
+		jbatch = 1;
+	jchain = jp = hrep.r_next;
+	clock_gettime(CLOCK_MONOTONIC, &jlast);
+}
+
+static HANDLE *jhandle(const char *dir, int makedirs)
+{
+	char p[PATH_MAX];
+
+	strcpy(p, dir);
+	return(checkdir(p, p + strlen(p), makedirs, NULL, NULL));
+}
+
+/* Is the action recorded in r, from ffrom in hfrom, to nto in hto, already
+   done? -1 if it can no longer be done. */
+static int jdid(const JREC *r, HANDLE *hfrom, FILENO ffrom, HANDLE *hto, const char *nto)
+{
+	FILENO fto = fsearch(nto, hto->h_di);
+	struct stat sstat, tstat;
+
+	if (op & MOVE) {
+		if (
+			ffrom == NOFILE ||
+			fstatat(dfd(hfrom->h_di), FNAME(hfrom->h_di, ffrom), &sstat, AT_SYMLINK_NOFOLLOW) ||
+			(uint64_t)sstat.st_dev != r->jr_dev || (uint64_t)sstat.st_ino != r->jr_ino
+		)
+			return(fto != NOFILE ? 1 : -1);
+		return(0);
+	}
+	if (ffrom == NOFILE)
+		return(-1);
+	if ((op & APPEND) || (r->jr_flags & J_FDEL) || fto == NOFILE)
+		return(0);
+	/* The target may be a copy cut short, so it only counts if it is
+	   what the action would have made; otherwise it is made again. */
+	if (fstatat(dfd(hto->h_di), nto, &tstat, AT_SYMLINK_NOFOLLOW))
+		return(0);
+	if (op & HARDLINK)
+		return((uint64_t)tstat.st_dev == r->jr_dev && (uint64_t)tstat.st_ino == r->jr_ino);
+	if (op & NORMCOPY) {
+		/* copy sets the time last. */
+		struct timespec smtime, tmtime;
+		if (fstatat(dfd(hfrom->h_di), FNAME(hfrom->h_di, ffrom), &sstat, 0))
+			return(0);
+		smtime = get_stat_mtime(&sstat);
+		tmtime = get_stat_mtime(&tstat);
+		return(
+			S_ISREG(tstat.st_mode) && tstat.st_size == sstat.st_size &&
+			smtime.tv_sec == tmtime.tv_sec && smtime.tv_nsec == tmtime.tv_nsec
+		);
+	}
+	return((op & SYMLINK) != 0);
+}
+
+static void jresume(const char *path)
+{
+	FILE *f;
+	JHEAD h;
+	JREC *recs;
+	char **strs;
+	JMARK m;
+	unsigned i, end, w = 0, aidx = 0;
+	uint32_t akind = 0;
+	int64_t aval = 0;
+
+	if ((f = fopen(path, "rb")) == NULL) {
+		fprintf(stderr, "%s : %s.\n", path, strerror(errno));
+		exit(1);
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.jh_magic, JMAGIC, sizeof(h.jh_magic)) != 0) {
+		fprintf(stderr, "%s : not an mmv journal.\n", path);
+		exit(1);
+	}
+	op = h.jh_op;
+	mkdirs = h.jh_mkdirs;
+	recs = (JREC *)xnmalloc(h.jh_nrecs, sizeof(JREC));
+	strs = (char **)xnmalloc(h.jh_nrecs, 4 * sizeof(char *));
+	for (i = 0; i < h.jh_nrecs; i++) {
+		if (fread(&recs[i], sizeof(JREC), 1, f) != 1)
+			goto bad;
+		for (unsigned j = 0; j < 4; j++) {
+			uint32_t len = recs[i].jr_len[j];
+			char *str = strs[4 * i + j] = xcharalloc(len + 1);
+			if (len == 0 || len > PATH_MAX || fread(str, 1, len, f) != len || str[len - 1] != '\0')
+				goto bad;
+		}
+	}
+	while (fread(&m, sizeof(m), 1, f) == 1)
+		if (m.jm_type == JM_DONE)
+			w = m.jm_index;
+		else {
+			akind = m.jm_type;
+			aidx = m.jm_index;
+			aval = m.jm_value;
+		}
+	fclose(f);
+
+	for (i = 0; i < h.jh_nrecs; i = end) {
+		int marked, tempthere = 0, headpending = 0;
+		char tname[STRLEN(TEMP) + 12];
+		REP *tail = NULL;
+
+		for (end = i + 1; end < h.jh_nrecs && !(recs[end].jr_flags & J_CHAIN); end++)
+			;
+		marked = akind != 0 && aidx == i;
+		sprintf(tname, "%s%03d", TEMP, (int)aval);
+		if (marked && akind == JM_ALIAS) {
+			HANDLE *ha = jhandle(strs[4 * (end - 1)], 0);
+			tempthere = ha != NULL && fsearch(tname, ha->h_di) != NOFILE;
+		}
+		for (unsigned j = i; j < end; j++) {
+			char **str = strs + 4 * j;
+			uint32_t flags = recs[j].jr_flags;
+			HANDLE *hfrom = jhandle(str[0], 0), *hto = jhandle(str[2], mkdirs);
+			FILENO ffrom = hfrom == NULL ? NOFILE : fsearch(str[1], hfrom->h_di);
+			int done = j < w;
+
+			if (!done && hto == NULL)
+				done = -1;
+			else if (!done && (flags & R_ISALIASED) && akind == JM_ALIAS && marked) {
+				if (tempthere && ffrom == NOFILE)
+					ffrom = fsearch(tname, hfrom->h_di);
+				done = tempthere ? 0 : !headpending;
+			}
+			else if (!done && !(flags & R_ISALIASED))
+				done = hfrom == NULL ? -1 : jdid(&recs[j], hfrom, ffrom, hto, str[3]);
+			else if (!done && ffrom == NOFILE)
+				done = -1;
+			if (flags & R_ISCYCLE)
+				headpending = !done;
+			if (done < 0) {
+				printf("%s%s -> %s%s : source or target directory has vanished.\n",
+					str[0], str[1], str[2], str[3]);
+				badreps++;
+			}
+			if (done)
+				continue;
+
+			REP *p = (REP *)xmalloc(sizeof(REP));
+			p->r_flags = (int)(flags & (R_ISALIASED | R_ISCYCLE | R_ONEDIRLINK));
+			p->r_hfrom = hfrom;
+			p->r_ffrom = ffrom;
+			p->r_hto = hto;
+			p->r_nto = str[3];
+			p->r_fdel = (flags & J_FDEL) ? fsearch(str[3], hto->h_di) : NOFILE;
+			p->r_thendo = NULL;
+			p->r_next = NULL;
+			if (tail == NULL) {
+				lastrep->r_next = p;
+				lastrep = p;
+				p->r_first = p;
+			}
+			else {
+				tail->r_thendo = p;
+				p->r_first = tail->r_first;
+			}
+			tail = p;
+			nreps++;
+			strcpy(pathbuf, str[0]);
+			strcat(pathbuf, FNAME(hfrom->h_di, ffrom));
+			getstat(pathbuf, hfrom->h_di, ffrom);
+		}
+		if (marked && tail != NULL) {
+			REP *first = tail->r_first;
+			if (akind == JM_ALIAS ? tempthere : !(first->r_flags & R_ISCYCLE)) {
+				jcycle = first;
+				jalias = (int)aval;
+				jaliaslen = (long)aval;
+			}
+		}
+	}
+	return;
+
+bad:
+	fprintf(stderr, "%s : journal is damaged.\n", path);
+	exit(1);
+}
+
+/* Plans
+
+   --plan-out FILE writes the final plan to FILE instead of carrying it
+   out, and --apply FILE carries it out later, without matching any
+   patterns. The file is used in place, mapped if possible: a header, then
+   a record per directory, per handle and per action, then each
+   directory's listing in the layout of the directory cache, cut down to
+   the names the plan uses, then the strings. Actions refer to handles and
+   handles to directories by index, so each directory is named only once.
+
+   Before a plan is applied, each existing directory in it is checked to
+   have the same device, inode and times as when the plan was made, and
+   each missing one to be missing still, so that no name the plan relies
+   on can have come or gone in between. */
+
+#define PLMAGIC "mmvplan2"
+
+typedef struct {
+	char pl_magic[8];
+	uint32_t pl_order;		/* DCORDER */
+	uint32_t pl_recsize;	/* sizeof(PLREP) */
+	int32_t pl_op, pl_mkdirs;
+	uint32_t pl_ndirs, pl_nhandles, pl_nreps, pl_pad;
+	uint64_t pl_strs, pl_strslen;	/* offset and size of the strings */
+	int64_t pl_time;		/* when mmv started to read the directories */
+} PLHEAD;
+
+typedef struct {
+	DCRECORD pd_rec;		/* unused if DI_NONEXISTENT */
+	uint64_t pd_path;		/* offset in the strings */
+	uint32_t pd_flags, pd_pad;
+} PLDIR;
+
+typedef struct {
+	uint64_t ph_name;
+	uint32_t ph_dir, ph_pad;
+} PLHANDLE;
+
+/* pr_flags holds the r_flags to keep, with J_CHAIN and J_FDEL. */
+typedef struct {
+	uint32_t pr_hfrom, pr_ffrom, pr_hto, pr_fdel;
+	uint32_t pr_flags, pr_mode, pr_stflags, pr_pad;
+	uint64_t pr_nto;
+} PLREP;
+
+typedef struct {
+	const void *pk_p;
+	FILENO *pk_map;			/* for directories, old FILENO to new */
+	uint64_t pk_nameslen;
+} PLKEY;
+
+static int plkeycmp(const void *p1, const void *p2)
+{
+	uintptr_t a = (uintptr_t)((const PLKEY *)p1)->pk_p, b = (uintptr_t)((const PLKEY *)p2)->pk_p;
+
+	return(a < b ? -1 : a > b);
+}
+
+/* Sort keys by pointer and drop duplicates, returning how many are left. */
+static size_t plunique(PLKEY *keys, size_t n)
+{
+	size_t m = 0;
+
+	qsort(keys, n, sizeof(PLKEY), plkeycmp);
+	for (size_t i = 0; i < n; i++)
+		if (m == 0 || keys[m - 1].pk_p != keys[i].pk_p)
+			keys[m++] = keys[i];
+	return(m);
+}
+
+static PLKEY *plfind(PLKEY *keys, size_t n, const void *p)
+{
+	PLKEY key;
+
+	key.pk_p = p;
+	return((PLKEY *)bsearch(&key, keys, n, sizeof(PLKEY), plkeycmp));
+}
+
+static time_t plantime;
+static char *plstrs;
+static size_t plstrslen, plstrsroom;
+
+static uint64_t plstr(const char *s)
+{
+	size_t n = strlen(s) + 1;
+	uint64_t off = plstrslen;
+
+	while (plstrslen + n > plstrsroom)
+		plstrs = (char *)x2nrealloc(plstrs, &plstrsroom, 1);
+	memcpy(plstrs + plstrslen, s, n);
+	plstrslen += n;
+	return(off);
+}
+
+static void plkeep(PLKEY *k, FILENO f)
+{
+	k->pk_map[f] = 0;
+}
+
+static void plansave(const char *path)
+{
+	PLKEY *hkeys, *dkeys;
+	size_t nh = 0, nd = 0, nr = 0;
+	PLHEAD h;
+	REP *first, *p;
+
+	for (first = hrep.r_next; first != NULL; first = first->r_next)
+		for (p = first; p != NULL; p = p->r_thendo)
+			nr++;
+	hkeys = (PLKEY *)xcalloc(2 * nr + 1, sizeof(PLKEY));
+	for (first = hrep.r_next; first != NULL; first = first->r_next)
+		for (p = first; p != NULL; p = p->r_thendo) {
+			hkeys[nh++].pk_p = p->r_hfrom;
+			hkeys[nh++].pk_p = p->r_hto;
+		}
+	nh = plunique(hkeys, nh);
+	dkeys = (PLKEY *)xcalloc(nh + 1, sizeof(PLKEY));
+	for (size_t i = 0; i < nh; i++)
+		dkeys[i].pk_p = ((const HANDLE *)hkeys[i].pk_p)->h_di;
+	nd = plunique(dkeys, nh);
+	for (size_t i = 0; i < nd; i++) {
+		const DIRINFO *di = (const DIRINFO *)dkeys[i].pk_p;
+		dkeys[i].pk_map = (FILENO *)xnmalloc(di->di_nfils + 1, sizeof(FILENO));
+		for (FILENO f = 0; f < di->di_nfils; f++)
+			dkeys[i].pk_map[f] = NOFILE;
+	}
+
+	/* Keep the names the actions use, and any temporary names already in
+	   directories where cycles are to be broken, which movealias must
+	   avoid. */
+	for (first = hrep.r_next; first != NULL; first = first->r_next)
+		for (p = first; p != NULL; p = p->r_thendo) {
+			DIRINFO *dto = p->r_hto->h_di;
+			PLKEY *kto = plfind(dkeys, nd, dto);
+			plkeep(plfind(dkeys, nd, p->r_hfrom->h_di), p->r_ffrom);
+			if (p->r_fdel != NOFILE)
+				plkeep(kto, p->r_fdel);
+			if (p->r_flags & R_ISALIASED)
+				for (
+					FILENO f = ffirst(TEMP, STRLEN(TEMP), dto);
+					f < dto->di_nfils && strncmp(FNAME(dto, f), TEMP, STRLEN(TEMP)) == 0;
+					f++
+				)
+					plkeep(kto, f);
+		}
+
+	plstrslen = 0;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.pl_magic, PLMAGIC, sizeof(h.pl_magic));
+	h.pl_order = DCORDER;
+	h.pl_recsize = sizeof(PLREP);
+	h.pl_op = op;
+	h.pl_mkdirs = mkdirs;
+	h.pl_ndirs = (uint32_t)nd;
+	h.pl_nhandles = (uint32_t)nh;
+	h.pl_nreps = (uint32_t)nr;
+	h.pl_time = (int64_t)plantime;
+	uint64_t data = sizeof(PLHEAD) + nd * sizeof(PLDIR) + nh * sizeof(PLHANDLE) +
+		nr * sizeof(PLREP);
+	PLDIR *pds = (PLDIR *)xcalloc(nd + 1, sizeof(PLDIR));
+	for (size_t i = 0; i < nd; i++) {
+		const DIRINFO *di = (const DIRINFO *)dkeys[i].pk_p;
+		PLDIR *d = &pds[i];
+		FILENO n = 0;
+		for (FILENO f = 0; f < di->di_nfils; f++)
+			if (dkeys[i].pk_map[f] != NOFILE) {
+				dkeys[i].pk_map[f] = n++;
+				dkeys[i].pk_nameslen += di->di_len[f] + 1u;
+			}
+		d->pd_path = plstr(di->di_path);
+		d->pd_flags = di->di_flags & DI_NONEXISTENT;
+		d->pd_rec.dr_dev = (uint64_t)di->di_vid;
+		d->pd_rec.dr_ino = (uint64_t)di->di_did;
+		d->pd_rec.dr_ctime = di->di_ctime.tv_sec;
+		d->pd_rec.dr_ctimens = di->di_ctime.tv_nsec;
+		d->pd_rec.dr_mtime = di->di_mtime.tv_sec;
+		d->pd_rec.dr_mtimens = di->di_mtime.tv_nsec;
+		d->pd_rec.dr_nfils = n;
+		d->pd_rec.dr_nameslen = dkeys[i].pk_nameslen;
+		d->pd_rec.dr_data = data;
+		data += dclistsize(n, dkeys[i].pk_nameslen);
+	}
+	PLHANDLE *phs = (PLHANDLE *)xcalloc(nh + 1, sizeof(PLHANDLE));
+	for (size_t i = 0; i < nh; i++) {
+		const HANDLE *hd = (const HANDLE *)hkeys[i].pk_p;
+		phs[i].ph_name = plstr(hd->h_name);
+		phs[i].ph_dir = (uint32_t)(plfind(dkeys, nd, hd->h_di) - dkeys);
+	}
+	PLREP *prs = (PLREP *)xcalloc(nr + 1, sizeof(PLREP)), *r = prs;
+	for (first = hrep.r_next; first != NULL; first = first->r_next)
+		for (p = first; p != NULL; p = p->r_thendo, r++) {
+			DIRINFO *dfrom = p->r_hfrom->h_di;
+			PLKEY *kfrom = plfind(dkeys, nd, dfrom), *kto = plfind(dkeys, nd, p->r_hto->h_di);
+			r->pr_hfrom = (uint32_t)(plfind(hkeys, nh, p->r_hfrom) - hkeys);
+			r->pr_ffrom = kfrom->pk_map[p->r_ffrom];
+			r->pr_hto = (uint32_t)(plfind(hkeys, nh, p->r_hto) - hkeys);
+			r->pr_fdel = p->r_fdel == NOFILE ? NOFILE : kto->pk_map[p->r_fdel];
+			r->pr_flags = (uint32_t)(p->r_flags &
+				(R_ISALIASED | R_ISCYCLE | R_ONEDIRLINK | R_DIRMOVE)) |
+				(p == first ? J_CHAIN : 0) | (p->r_fdel != NOFILE ? J_FDEL : 0);
+			r->pr_mode = (uint32_t)dfrom->di_mode[p->r_ffrom];
+			r->pr_stflags = dfrom->di_stflags[p->r_ffrom];
+			r->pr_nto = plstr(p->r_nto);
+		}
+	h.pl_strs = data;
+	h.pl_strslen = plstrslen;
+
+	char *tmp = xcharalloc(strlen(path) + 5);
+	FILE *fp;
+	sprintf(tmp, "%s.new", path);
+	if ((fp = fopen(tmp, "wb")) == NULL) {
+		fprintf(stderr, "%s : %s.\n", tmp, strerror(errno));
+		exit(1);
+	}
+	fwrite(&h, sizeof(h), 1, fp);
+	fwrite(pds, sizeof(PLDIR), nd, fp);
+	fwrite(phs, sizeof(PLHANDLE), nh, fp);
+	fwrite(prs, sizeof(PLREP), nr, fp);
+	for (size_t i = 0; i < nd; i++) {
+		const DIRINFO *di = (const DIRINFO *)dkeys[i].pk_p;
+		const FILENO *map = dkeys[i].pk_map;
+		FILENO n = pds[i].pd_rec.dr_nfils, f;
+		uint32_t off = 0;
+		for (f = 0; f < di->di_nfils; f++)
+			if (map[f] != NOFILE) {
+				fwrite(&off, sizeof(uint32_t), 1, fp);
+				off += di->di_len[f] + 1u;
+			}
+		for (f = 0; f < di->di_nfils; f++)
+			if (map[f] != NOFILE)
+				fwrite(&di->di_len[f], sizeof(unsigned short), 1, fp);
+		for (f = 0; f < di->di_nfils; f++)
+			if (map[f] != NOFILE)
+				fwrite(&di->di_type[f], 1, 1, fp);
+		for (f = 0; f < di->di_nfils; f++)
+			if (map[f] != NOFILE)
+				fwrite(FNAME(di, f), 1, di->di_len[f] + 1u, fp);
+		dcpad(fp, n * (sizeof(uint32_t) + sizeof(unsigned short) + 1) + dkeys[i].pk_nameslen);
+		free(dkeys[i].pk_map);
+	}
+	fwrite(plstrs, 1, plstrslen, fp);
+	if (ferror(fp) | fclose(fp) || rename(tmp, path)) {
+		fprintf(stderr, "%s : %s.\n", path, strerror(errno));
+		unlink(tmp);
+		exit(1);
+	}
+	free(tmp);
+	free(prs);
+	free(phs);
+	free(pds);
+	free(dkeys);
+	free(hkeys);
+}
+
+static const char *plstring(const char *map, const PLHEAD *h, uint64_t off)
+{
+	if (off >= h->pl_strslen || memchr(map + h->pl_strs + off, '\0', h->pl_strslen - off) == NULL)
+		return(NULL);
+	return(map + h->pl_strs + off);
+}
+
+static void planapply(const char *path)
+{
+	struct stat pstat, dstat;
+	char *map;
+	size_t size;
+	int fd, changed = 0;
+
+	if ((fd = open(path, O_RDONLY | O_BINARY)) < 0 || fstat(fd, &pstat)) {
+		fprintf(stderr, "%s : %s.\n", path, strerror(errno));
+		exit(1);
+	}
+	size = (size_t)pstat.st_size;
+	if (size < sizeof(PLHEAD))
+		goto bad;
+#ifdef HAVE_SYS_MMAN_H
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s : %s.\n", path, strerror(errno));
+		exit(1);
+	}
+#else
+	map = xcharalloc(size);
+	if (read(fd, map, size) != (ssize_t)size)
+		goto bad;
+#endif
+	close(fd);
+
+	const PLHEAD *h = (const PLHEAD *)map;
+	if (memcmp(h->pl_magic, PLMAGIC, sizeof(h->pl_magic)) != 0) {
+		fprintf(stderr, "%s : not an mmv plan.\n", path);
+		exit(1);
+	}
+	uint64_t end = sizeof(PLHEAD) + (uint64_t)h->pl_ndirs * sizeof(PLDIR) +
+		(uint64_t)h->pl_nhandles * sizeof(PLHANDLE) + (uint64_t)h->pl_nreps * sizeof(PLREP);
+	if (
+		h->pl_order != DCORDER ||
+		h->pl_recsize != sizeof(PLREP) ||
+		end > size ||
+		h->pl_strs > size ||
+		h->pl_strslen != size - h->pl_strs
+	)
+		goto bad;
+	op = h->pl_op;
+	mkdirs = h->pl_mkdirs;
+	const PLDIR *pds = (const PLDIR *)(map + sizeof(PLHEAD));
+	const PLHANDLE *phs = (const PLHANDLE *)(pds + h->pl_ndirs);
+	const PLREP *prs = (const PLREP *)(phs + h->pl_nhandles);
+
+	DIRINFO **pdirs = (DIRINFO **)xnmalloc(h->pl_ndirs + 1, sizeof(DIRINFO *));
+	for (uint32_t i = 0; i < h->pl_ndirs; i++) {
+		const PLDIR *d = &pds[i];
+		const DCRECORD *r = &d->pd_rec;
+		const char *dpath = plstring(map, h, d->pd_path);
+		int isdir;
+
+		if (dpath == NULL)
+			goto bad;
+		isdir = stat(dpath, &dstat) == 0 && (dstat.st_mode & S_IFMT) == S_IFDIR;
+		if (d->pd_flags & DI_NONEXISTENT) {
+			if (isdir) {
+				printf("%s : has been made since the plan was.\n", dpath);
+				changed = 1;
+			}
+			pdirs[i] = dtrieadd(dpath);
+			continue;
+		}
+		if (!dcvalid(map, size, r))
+			goto bad;
+		if (
+			!isdir ||
+			(uint64_t)dstat.st_dev != r->dr_dev ||
+			(uint64_t)dstat.st_ino != r->dr_ino ||
+			get_stat_ctime(&dstat).tv_sec != r->dr_ctime ||
+			get_stat_ctime(&dstat).tv_nsec != r->dr_ctimens ||
+			get_stat_mtime(&dstat).tv_sec != r->dr_mtime ||
+			get_stat_mtime(&dstat).tv_nsec != r->dr_mtimens
+		) {
+			printf("%s : has changed since the plan was made.\n", dpath);
+			changed = 1;
+			continue;
+		}
+		/* As with the directory cache, a change in the same clock tick as
+		   the listing was read could have been missed. */
+		if (r->dr_ctime + DCSLACK >= h->pl_time) {
+			printf("%s : was changing when the plan was made.\n", dpath);
+			changed = 1;
+			continue;
+		}
+		DIRINFO *di = pdirs[i] = dadd(dstat.st_dev, dstat.st_ino);
+		di->di_path = dpath;
+		di->di_ctime = get_stat_ctime(&dstat);
+		di->di_mtime = get_stat_mtime(&dstat);
+		dclisting(di, map, r);
+		dalloc(di, 0);
+	}
+	if (changed) {
+		fprintf(stderr, "%s : plan is out of date.\n", path);
+		quit();
+	}
+
+	HANDLE **phandles = (HANDLE **)xnmalloc(h->pl_nhandles + 1, sizeof(HANDLE *));
+	for (uint32_t i = 0; i < h->pl_nhandles; i++) {
+		const char *name = plstring(map, h, phs[i].ph_name);
+		if (name == NULL || phs[i].ph_dir >= h->pl_ndirs)
+			goto bad;
+		phandles[i] = hadd((char *)name);
+		phandles[i]->h_di = pdirs[phs[i].ph_dir];
+	}
+
+	REP *tail = NULL;
+	for (uint32_t i = 0; i < h->pl_nreps; i++) {
+		const PLREP *r = &prs[i];
+		const char *nto = plstring(map, h, r->pr_nto);
+		if (
+			nto == NULL ||
+			r->pr_hfrom >= h->pl_nhandles || r->pr_hto >= h->pl_nhandles ||
+			(i == 0 && !(r->pr_flags & J_CHAIN))
+		)
+			goto bad;
+		HANDLE *hfrom = phandles[r->pr_hfrom], *hto = phandles[r->pr_hto];
+		if (
+			r->pr_ffrom >= hfrom->h_di->di_nfils ||
+			(r->pr_fdel != NOFILE && r->pr_fdel >= hto->h_di->di_nfils)
+		)
+			goto bad;
+
+		REP *p = (REP *)xmalloc(sizeof(REP));
+		p->r_flags = (int)(r->pr_flags & (R_ISALIASED | R_ISCYCLE | R_ONEDIRLINK | R_DIRMOVE));
+		p->r_hfrom = hfrom;
+		p->r_ffrom = r->pr_ffrom;
+		p->r_hto = hto;
+		p->r_nto = (char *)nto;
+		p->r_fdel = r->pr_fdel;
+		p->r_thendo = NULL;
+		p->r_next = NULL;
+		if (r->pr_flags & J_CHAIN) {
+			lastrep->r_next = p;
+			lastrep = p;
+			p->r_first = p;
+		}
+		else {
+			tail->r_thendo = p;
+			p->r_first = tail->r_first;
+		}
+		tail = p;
+		nreps++;
+		hfrom->h_di->di_mode[p->r_ffrom] = (mode_t)r->pr_mode;
+		hfrom->h_di->di_stflags[p->r_ffrom] = (unsigned short)(r->pr_stflags | FI_STTAKEN);
+	}
+	free(phandles);
+	free(pdirs);
+	return;
+
+bad:
+	fprintf(stderr, "%s : plan is damaged.\n", path);
+	exit(1);
+}
+
+static void showdone(void)
+{
+	streamshow(stdout);
+	for (REP *first = hrep.r_next; first != NULL; first = first->r_next)
+		for (REP *p = first; p != NULL; p = p->r_thendo) {
+			if (!(p->r_flags & R_DONE))
+				continue;
 			printf("%s%s %c%c %s%s : done%s\n",
-				p->r_hfrom->h_name, p->r_ffrom->fi_name,
+				p->r_hfrom->h_name, FNAME(p->r_hfrom->h_di, p->r_ffrom),
 				p->r_flags & R_ISALIASED ? '=' : '-',
 				p->r_flags & R_ISCYCLE ? '^' : '>',
 				p->r_hto->h_name, p->r_nto,
-				(p->r_fdel != NULL && !(op & APPEND)) ? " (*)" : "");
+				(p->r_fdel != NOFILE && !(op & APPEND)) ? " (*)" : "");
 		}
 }
 
@@ -1481,21 +3858,38 @@ static int snap(REP *first, REP *p)
 		exit(1);
 
 	failed = 1;
+	jprogress(1);
 	signal(SIGINT, breakstat);
 	if (!verbose)
-		showdone(p);
+		showdone();
 	printf("The following left undone:\n");
 	noex = 1;
 	return(first != p);
 }
 
+/* Put the full source and target names of p in pathbuf and fullrep, for
+   messages; the operations themselves use names relative to directory
+   descriptors. Return the start of the file name in pathbuf. */
+static char *repnames(REP *p, const char *sname)
+{
+	char *fstart;
+
+	strcpy(fullrep, p->r_hto->h_name);
+	strcat(fullrep, p->r_nto);
+	strcpy(pathbuf, p->r_hfrom->h_name);
+	fstart = pathbuf + strlen(pathbuf);
+	strcpy(fstart, sname);
+	return(fstart);
+}
+
 static long appendalias(REP *first, REP *p, int *pprintaliased)
 {
 	long ret = 0l;
 
 	struct stat fstat;
 
-	if (stat(fullrep, &fstat)) {
+	if (fstatat(dfd(p->r_hto->h_di), p->r_nto, &fstat, 0)) {
+		repnames(p, "");
 		fprintf(stderr, "append cycle stat on %s has failed.\n", fullrep);
 		*pprintaliased = snap(first, p);
 	}
@@ -1505,189 +3899,2095 @@ static long appendalias(REP *first, REP *p, int *pprintaliased)
 	return(ret);
 }
 
-static int movealias(REP *first, REP *p, int *pprintaliased)
+/* Rename only if nothing is there, failing with ENOSYS or EINVAL where
+   the system cannot make sure of that. */
+static int renamexcl(int fromfd, const char *fname, int tofd, const char *tname)
 {
-	char *fstart;
-	int ret;
+#ifdef HAVE_RENAMEAT2
+	return(renameat2(fromfd, fname, tofd, tname, RENAME_NOREPLACE));
+#else
+	errno = ENOSYS;
+	return(-1);
+#endif
+}
 
-	strcpy(pathbuf, p->r_hto->h_name);
-	fstart = pathbuf + strlen(pathbuf);
-	strcpy(fstart, TEMP);
-	for (
-		ret = 0;
-		sprintf(fstart + STRLEN(TEMP), "%03d", ret),
-		fsearch(fstart, p->r_hto->h_di) != NULL;
-		ret++
-	)
-		;
-	if (rename(fullrep, pathbuf)) {
+/* Rename without replacing anything, where the system can. */
+static int renamenew(int fromfd, const char *fname, int tofd, const char *tname)
+{
+	int ret = renamexcl(fromfd, fname, tofd, tname);
+
+	if (ret == 0 || (errno != EINVAL && errno != ENOSYS))
+		return(ret);
+	return(renameat(fromfd, fname, tofd, tname));
+}
+
+static int movealias(REP *first, REP *p, int *pprintaliased, unsigned k)
+{
+	char tname[STRLEN(TEMP) + 12];
+	int ret, bad;
+	DIRINFO *dto = p->r_hto->h_di;
+
+	strcpy(tname, TEMP);
+	/* Another shard may be breaking a cycle in the same directory, so the
+	   name is only taken if nothing has been put there since it was read. */
+	for (ret = 0; ; ret++) {
+		sprintf(tname + STRLEN(TEMP), "%03d", ret);
+		if (fsearch(tname, dto) != NOFILE)
+			continue;
+		jnote(JM_ALIAS, k, ret);
+		if ((bad = renamenew(dfd(dto), p->r_nto, dfd(dto), tname)) == 0 || errno != EEXIST)
+			break;
+	}
+	if (bad) {
+		repnames(p, "");
 		fprintf(stderr,
-			"%s -> %s has failed.\n", fullrep, pathbuf);
+			"%s -> %s%s has failed.\n", fullrep, p->r_hto->h_name, tname);
 		*pprintaliased = snap(first, p);
 	}
 	return(ret);
 }
 
+/* Throttling
+
+   --max-ops-per-sec and --bwlimit are enforced with token buckets that
+   fill at the given rate and hold at most a second's worth. Taking more
+   than there is puts the bucket in debt, and the caller sleeps until it is
+   paid off, so the long-run rate never exceeds the limit. */
+
+typedef struct {
+	double tb_rate;			/* per second, or 0 for no limit */
+	double tb_tokens;
+	double tb_burst;
+	struct timespec tb_last;
+} BUCKET;
+
+static BUCKET opbucket, bwbucket;
+
+static void bucketinit(BUCKET *b, double rate, double burst)
+{
+	b->tb_rate = rate;
+	b->tb_burst = burst > rate ? burst : rate;
+	b->tb_tokens = b->tb_burst;
+	clock_gettime(CLOCK_MONOTONIC, &b->tb_last);
+}
+
+static void throttle(BUCKET *b, double n)
+{
+	struct timespec now;
+
+	if (b->tb_rate <= 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	b->tb_tokens += ((double)(now.tv_sec - b->tb_last.tv_sec) +
+		(double)(now.tv_nsec - b->tb_last.tv_nsec) / 1e9) * b->tb_rate;
+	if (b->tb_tokens > b->tb_burst)
+		b->tb_tokens = b->tb_burst;
+	b->tb_last = now;
+	if ((b->tb_tokens -= n) < 0) {
+		double wait = -b->tb_tokens / b->tb_rate;
+		struct timespec ts;
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+		while (nanosleep(&ts, &ts) && errno == EINTR && !gotsig)
+			;
+	}
+}
+
+/* Parse a byte count with an optional binary suffix, K, M, G or T. */
+static double parsesize(const char *s)
+{
+	char *end;
+	double n = strtod(s, &end);
+	static const char suffixes[] = "KMGT";
+	const char *suf;
+
+	if (end != s && *end != '\0' && (suf = strchr(suffixes, toupper((unsigned char)*end))) != NULL) {
+		for (const char *q = suffixes; q <= suf; q++)
+			n *= 1024;
+		end++;
+		if (*end == 'B' || *end == 'b')
+			end++;
+	}
+	if (end == s || *end != '\0' || !(n > 0)) {
+		fprintf(stderr, "%s : bad size.\n", s);
+		exit(1);
+	}
+	return(n);
+}
+
+/* Set the I/O scheduling class and level of the process, given as
+   idle, best-effort[:LEVEL] or realtime[:LEVEL], or as 1 to 3 for realtime,
+   best-effort and idle, as with ionice(1). */
+static void setionice(const char *arg)
+{
+	static const char *classes[] = {"realtime", "best-effort", "idle"};
+	const char *colon = strchr(arg, ':');
+	size_t len = colon != NULL ? (size_t)(colon - arg) : strlen(arg);
+	long class = 0, level = 4;
+	char *end;
+
+	for (int i = 0; i < 3; i++)
+		if (strlen(classes[i]) == len && strncmp(arg, classes[i], len) == 0)
+			class = i + 1;
+	if (class == 0 && len == 1 && *arg >= '1' && *arg <= '3')
+		class = *arg - '0';
+	if (colon != NULL) {
+		level = strtol(colon + 1, &end, 10);
+		if (*end != '\0' || end == colon + 1)
+			class = 0;
+	}
+	if (class == 0 || level < 0 || level > 7 || (class == 3 && colon != NULL)) {
+		fprintf(stderr, "%s : bad I/O scheduling class.\n", arg);
+		exit(1);
+	}
+#if defined __linux__ && defined SYS_ioprio_set
+	/* IOPRIO_WHO_PROCESS, with the class in the top 3 of 16 bits. */
+	if (syscall(SYS_ioprio_set, 1, 0, (int)(class << 13 | (class == 3 ? 0 : level))) != 0)
+		fprintf(stderr, "Strange, couldn't set I/O scheduling class: %s.\n", strerror(errno));
+#else
+	fprintf(stderr, "Setting the I/O scheduling class is not supported on this system.\n");
+#endif
+}
+
 #define IRWMASK (S_IRUSR | S_IWUSR)
 #define RWMASK (IRWMASK | (IRWMASK >> 3) | (IRWMASK >> 6))
 
-static int copy(FILEINFO *ff, off_t len)
+/* Statistics, reported with --stats */
+
+static int showstats = 0;
+static struct {
+	struct timespec st_start;
+	uintmax_t st_bytes;		/* copied */
+	unsigned st_prefetched;
+	uintmax_t st_verified;		/* read back */
+	double st_vsecs;		/* reading back */
+} stats;
+
+static void copied(ssize_t k)
 {
-	char buf[BUFSIZ];
-	int f, t, mode;
-	mode_t perm;
+	throttle(&bwbucket, (double)k);
+	stats.st_bytes += (uintmax_t)k;
+}
+
+/* Verification
+
+   With --verify, a copy that is to be followed by deleting its source, for
+   -x or a move across devices, is checked first. A CRC32C of the data is
+   taken as it is copied, holes counting as zeros, so that the source is
+   read only once; the target is then written back, dropped from the cache
+   and read again, and its CRC must match. */
+
+#define VERIFYBUF (1024 * 1024)
+
+static int verify = 0, hashing = 0;
+static uint32_t crc, crctab[256];
+static uint32_t (*crcfn)(uint32_t c, const char *buf, size_t n);
+static char *verifybuf = NULL;
+
+static uint32_t crctable(uint32_t c, const char *buf, size_t n)
+{
+	while (n-- > 0)
+		c = crctab[(c ^ (unsigned char)*buf++) & 0xff] ^ (c >> 8);
+	return(c);
+}
+
+#if defined __GNUC__ && defined __x86_64__
+__attribute__((target("sse4.2")))
+static uint32_t crcsse42(uint32_t c, const char *buf, size_t n)
+{
+	uint64_t c64 = c, w;
+
+	for (; n >= 8; buf += 8, n -= 8) {
+		memcpy(&w, buf, 8);
+		c64 = _mm_crc32_u64(c64, w);
+	}
+	c = (uint32_t)c64;
+	while (n-- > 0)
+		c = _mm_crc32_u8(c, (unsigned char)*buf++);
+	return(c);
+}
+#endif
+
+static void crcinit(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		crctab[i] = c;
+	}
+	crcfn = crctable;
+#if defined __GNUC__ && defined __x86_64__
+	if (__builtin_cpu_supports("sse4.2"))
+		crcfn = crcsse42;
+#endif
+}
+
+static void hashdata(const char *buf, size_t n)
+{
+	crc = crcfn(crc, buf, n);
+}
+
+static void hashzeros(off_t n)
+{
+	static const char zeros[BUFSIZ];
+
+	for (; n > 0; n -= BUFSIZ)
+		hashdata(zeros, n < BUFSIZ ? (size_t)n : BUFSIZ);
+}
+
+/* Read back t, which should hold the data hashed into crc. */
+static int verifycopy(int t)
+{
+	struct timespec a, b;
+	uint32_t c = 0xffffffff;
 	ssize_t k;
-	struct utimbuf tim;
-	struct stat fstat;
 
-	if ((f = open(pathbuf, O_RDONLY | O_BINARY, 0)) < 0)
+	if (verifybuf == NULL)
+		verifybuf = (char *)xmalloc(VERIFYBUF);
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	if (fdatasync(t))
+		return(-1);
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(t, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+	if (lseek(t, (off_t)0, SEEK_SET) != 0)
 		return(-1);
+	while ((k = read(t, verifybuf, VERIFYBUF)) > 0) {
+		c = crcfn(c, verifybuf, (size_t)k);
+		stats.st_verified += (uintmax_t)k;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	stats.st_vsecs += (double)(b.tv_sec - a.tv_sec) +
+		(double)(b.tv_nsec - a.tv_nsec) / 1e9;
+	return(k < 0 || c != crc ? -1 : 0);
+}
+
+/* Read-ahead
+
+   In the copy modes, while one source is copied, the next prefetchdepth
+   sources in plan order are opened and the system is asked to start
+   reading them, so that the device does not sit idle between files. */
+
+static unsigned prefetchdepth = 0;
+
+static int readsdata(REP *p)
+{
+	return(
+		(op & (COPY | APPEND)) ||
+		((op & XMOVE) && p->r_hto->h_di->di_vid != p->r_hfrom->h_di->di_vid)
+	);
+}
+
+/* Prefetch the sources of p, which is about to be done, and of the
+   prefetchdepth actions after it, that have not been prefetched yet. */
+static void prefetch(REP *first, REP *p)
+{
+	for (unsigned n = 0; n <= prefetchdepth && p != NULL; n++) {
+		if (
+			!(p->r_flags & (R_PREFETCHED | R_ISALIASED)) &&
+			readsdata(p)
+		) {
+			p->r_flags |= R_PREFETCHED;
+#ifdef HAVE_POSIX_FADVISE
+			DIRINFO *d = p->r_hfrom->h_di;
+			int fd = openat(dfd(d), FNAME(d, p->r_ffrom), O_RDONLY);
+			if (fd >= 0) {
+				posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+				close(fd);
+				stats.st_prefetched++;
+			}
+#endif
+		}
+		if ((p = p->r_thendo) == NULL && (first = first->r_next) != NULL)
+			p = first;
+	}
+}
+
+static void printstats(unsigned ndone)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double secs = (double)(now.tv_sec - stats.st_start.tv_sec) +
+		(double)(now.tv_nsec - stats.st_start.tv_nsec) / 1e9;
+	fprintf(stderr, "%u actions done in %.3f seconds.\n", ndone, secs);
+	if (op & (COPY | APPEND | XMOVE))
+		fprintf(stderr, "%ju bytes copied (%.1f MB/s).\n", stats.st_bytes,
+			secs > 0 ? (double)stats.st_bytes / secs / 1e6 : 0.0);
+	if (prefetchdepth > 0)
+		fprintf(stderr, "Prefetch depth %u; %u sources prefetched.\n",
+			prefetchdepth, stats.st_prefetched);
+	if (verify)
+		fprintf(stderr, "%ju bytes verified (%.1f MB/s).\n", stats.st_verified,
+			stats.st_vsecs > 0 ? (double)stats.st_verified / stats.st_vsecs / 1e6 : 0.0);
+}
+
+/* Copying without the page cache
+
+   With --direct, whole-file copies are done with O_DIRECT, through an
+   aligned buffer, so that they do not push other data out of the page
+   cache; the unaligned tail, if any, is written normally. Where O_DIRECT
+   cannot be used, and for appends and sparse copies, whose offsets need
+   not be aligned, the copied data is instead written back and dropped from
+   the cache every DROPWINDOW bytes. */
+
+#define DIRECTALIGN 4096
+#define DIRECTBUF (1024 * 1024)
+#define DROPWINDOW (8 * 1024 * 1024)
+
+static int directio = 0;
+static char *directbuf = NULL;
+
+/* Drop n bytes copied from fpos in f to tpos in t from the page cache;
+   n == 0 means up to the end of the files. */
+static void dropcache(int f _GL_UNUSED, int t, off_t fpos _GL_UNUSED, off_t tpos _GL_UNUSED, off_t n _GL_UNUSED)
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range(t, tpos, n, SYNC_FILE_RANGE_WAIT_BEFORE |
+		SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+	fdatasync(t);
+#endif
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(t, tpos, n, POSIX_FADV_DONTNEED);
+	posix_fadvise(f, fpos, n, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/* Copy n bytes, or up to the end of f if n is -1, from f to t at their
+   current offsets. Running out of data early is not an error. The kernel
+   copies in COPYCHUNK pieces where it can, which may share extents on
+   filesystems that support it; otherwise the data goes through buf. */
+
+#define COPYCHUNK (1024 * 1024)
+
+static int copyrange(int f, int t, off_t n)
+{
+	char buf[BUFSIZ];
+	ssize_t k = 0;
+	off_t fpos = 0, tpos = 0, undropped = 0;
+
+	if (directio) {
+		fpos = lseek(f, 0, SEEK_CUR);
+		tpos = lseek(t, 0, SEEK_CUR);
+	}
+#ifdef HAVE_COPY_FILE_RANGE
+	else if (!hashing) {
+		off_t moved = 0;
+		while (
+			n != 0 &&
+			(k = copy_file_range(f, NULL, t, NULL,
+				(n < 0 || n > COPYCHUNK) ? COPYCHUNK : (size_t)n, 0)) > 0
+		) {
+			if (n > 0)
+				n -= k;
+			moved += k;
+			copied(k);
+		}
+		if (n == 0 || (k == 0 && moved > 0))
+			return(0);
+		if (k < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+			errno != EOPNOTSUPP && errno != EBADF)
+			return(-1);
+		/* Not supported here, or nothing copied from what may be a file
+		   that only reads; carry on from the current offsets. */
+	}
+#endif
+	while (
+		n != 0 &&
+		(k = read(f, buf, (n < 0 || n > BUFSIZ) ? BUFSIZ : (size_t)n)) > 0
+	) {
+		if (write(t, buf, (size_t)k) != k)
+			return(-1);
+		if (hashing)
+			hashdata(buf, (size_t)k);
+		if (n > 0)
+			n -= k;
+		copied(k);
+		if (directio && (undropped += k) >= DROPWINDOW) {
+			dropcache(f, t, fpos, tpos, undropped);
+			fpos += undropped;
+			tpos += undropped;
+			undropped = 0;
+		}
+	}
+	if (directio && undropped > 0)
+		dropcache(f, t, fpos, tpos, undropped);
+	return(k < 0 ? -1 : 0);
+}
+
+/* Copy all of f to t, both at offset 0, with O_DIRECT if possible. */
+static int copydirect(int f, int t)
+{
+#ifdef O_DIRECT
+	int fflags = fcntl(f, F_GETFL), tflags = fcntl(t, F_GETFL), refused;
+	ssize_t k, w = 0;
+	off_t done = 0;
+
+	if (
+		fflags < 0 || tflags < 0 ||
+		fcntl(f, F_SETFL, fflags | O_DIRECT) ||
+		fcntl(t, F_SETFL, tflags | O_DIRECT)
+	) {
+		fcntl(f, F_SETFL, fflags);
+		return(copyrange(f, t, (off_t)-1));
+	}
+	if (directbuf == NULL) {
+		char *p = (char *)xmalloc(DIRECTBUF + DIRECTALIGN);
+		directbuf = p + (DIRECTALIGN - (uintptr_t)p % DIRECTALIGN) % DIRECTALIGN;
+	}
+	while ((k = read(f, directbuf, DIRECTBUF)) > 0) {
+		if (k % DIRECTALIGN != 0) {
+			/* The tail, which ends the file. */
+			fcntl(f, F_SETFL, fflags);
+			fcntl(t, F_SETFL, tflags);
+		}
+		if ((w = write(t, directbuf, (size_t)k)) != k)
+			break;
+		if (hashing)
+			hashdata(directbuf, (size_t)k);
+		copied(k);
+		done += k;
+	}
+	refused = (k < 0 || w < 0) && errno == EINVAL;
+	fcntl(f, F_SETFL, fflags);
+	fcntl(t, F_SETFL, tflags);
+	dropcache(f, t, 0, 0, 0);
+	if (refused) {
+		/* Some file systems take O_DIRECT but refuse the transfers;
+		   go on without it from where the copy got to. */
+		if (lseek(f, done, SEEK_SET) < 0 || lseek(t, done, SEEK_SET) < 0)
+			return(-1);
+		return(copyrange(f, t, (off_t)-1));
+	}
+	return(k != 0 ? -1 : 0);
+#else
+	return(copyrange(f, t, (off_t)-1));
+#endif
+}
+
+#ifdef SEEK_HOLE
+/* Copy the data extents of f, of the given size, to t, leaving holes. */
+static int copysparse(int f, int t, off_t size)
+{
+	off_t data, hole = 0;
+
+	while (hole < size) {
+		if ((data = lseek(f, hole, SEEK_DATA)) < 0) {
+			if (errno != ENXIO)
+				return(-1);
+			break;
+		}
+		if (hashing)
+			hashzeros(data - hole);
+		if (
+			(hole = lseek(f, data, SEEK_HOLE)) < 0 ||
+			lseek(f, data, SEEK_SET) < 0 ||
+			lseek(t, data, SEEK_SET) < 0 ||
+			copyrange(f, t, hole - data)
+		)
+			return(-1);
+	}
+	if (hashing && hole < size)
+		hashzeros(size - hole);
+	return(ftruncate(t, size));
+}
+#endif
+
+/* Does f, of the given status, have holes that can be found? */
+static int issparse(int f _GL_UNUSED, const struct stat *st _GL_UNUSED)
+{
+#if defined SEEK_HOLE && defined HAVE_STRUCT_STAT_ST_BLOCKS
+	if (
+		S_ISREG(st->st_mode) &&
+		st->st_blocks * 512 < st->st_size &&
+		(lseek(f, 0, SEEK_DATA) >= 0 || errno == ENXIO)
+	)
+		return(1);
+#endif
+	return(0);
+}
+
+/* Reserve space for n bytes at offset in t, without changing its size,
+   so that the file system can lay it out in one go. */
+static void prealloc(int t _GL_UNUSED, off_t offset _GL_UNUSED, off_t n _GL_UNUSED)
+{
+#if defined HAVE_FALLOCATE && defined FALLOC_FL_KEEP_SIZE
+	if (n > 0)
+		fallocate(t, FALLOC_FL_KEEP_SIZE, offset, n);
+#endif
+}
+
+static int copy(REP *p, const char *sname, off_t len)
+{
+	int f, t, mode, res, tfd = dfd(p->r_hto->h_di);
+	mode_t perm, fmode = p->r_hfrom->h_di->di_mode[p->r_ffrom];
+	struct stat sstat;
+
+	if ((f = openat(dfd(p->r_hfrom->h_di), sname, O_RDONLY | O_BINARY, 0)) < 0)
+		return(-1);
+	if (fstat(f, &sstat)) {
+		close(f);
+		return(-1);
+	}
 	perm = (op & (APPEND | OVERWRITE)) ?
-		(~oldumask & RWMASK) | (ff->fi_mode & (mode_t)~RWMASK) :
-		ff->fi_mode;
+		(~oldumask & RWMASK) | (fmode & (mode_t)~RWMASK) :
+		fmode;
 
-	mode = O_CREAT | (op & APPEND ? 0 : O_TRUNC) | O_WRONLY;
-	t = open(fullrep, mode, perm);
+	mode = O_CREAT | (op & APPEND ? 0 : O_TRUNC) | (hashing ? O_RDWR : O_WRONLY);
+	t = openat(tfd, p->r_nto, mode, perm);
 	if (t < 0) {
 		close(f);
 		return(-1);
 	}
-	if (op & APPEND)
-		lseek(t, (off_t)0, SEEK_END);
-	if ((op & APPEND) && len != (off_t)-1) {
-		while (
-			len != 0 &&
-			(k = read(f, buf, (len > BUFSIZ) ? BUFSIZ : (size_t)len)) > 0 &&
-			write(t, buf, (size_t)k) == k
-		)
-			len -= k;
-		if (len == 0)
-			k = 0;
-	}
+	crc = 0xffffffff;
+#ifdef SEEK_HOLE
+	if (!(op & APPEND) && issparse(f, &sstat))
+		res = copysparse(f, t, sstat.st_size);
 	else
-		while ((k = read(f, buf, BUFSIZ)) > 0 && write(t, buf, (size_t)k) == k)
-			;
-	if (!(op & (APPEND | OVERWRITE)))
-		if (
-			stat(pathbuf, &fstat) ||
-			(
-				tim.actime = fstat.st_atime,
-				tim.modtime = fstat.st_mtime,
-				utime(fullrep, &tim)
-			)
-		)
+#endif
+	{
+		off_t at = (op & APPEND) ? lseek(t, (off_t)0, SEEK_END) : 0;
+		if ((op & APPEND) && len != (off_t)-1) {
+			prealloc(t, at, len < sstat.st_size ? len : sstat.st_size);
+			res = copyrange(f, t, len);
+		}
+		else {
+			prealloc(t, at, sstat.st_size);
+			res = (directio && !(op & APPEND)) ?
+				copydirect(f, t) : copyrange(f, t, (off_t)-1);
+		}
+	}
+	if (!(op & (APPEND | OVERWRITE))) {
+		struct timespec tim[2];
+		tim[0] = get_stat_atime(&sstat);
+		tim[1] = get_stat_mtime(&sstat);
+		if (futimens(t, tim)) {
+			repnames(p, sname);
 			fprintf(stderr, "Strange, couldn't transfer time from %s to %s.\n",
 				pathbuf, fullrep);
+		}
+	}
+
+	if (res == 0 && hashing && verifycopy(t)) {
+		repnames(p, sname);
+		fprintf(stderr, "%s -> %s : verification failed.\n", pathbuf, fullrep);
+		res = -1;
+	}
 
 	close(f);
 	close(t);
-	if (k != 0) {
+	if (res != 0) {
 		if (!(op & APPEND))
-			unlink(fullrep);
+			unlinkat(tfd, p->r_nto, 0);
+		return(-1);
+	}
+	return(0);
+}
+
+static int myunlink(int fd, const char *name, const char *dname)
+{
+	if (unlinkat(fd, name, 0)) {
+		fprintf(stderr, "Strange, cannot unlink %s%s.\n", dname, name);
 		return(-1);
 	}
 	return(0);
 }
 
-static int myunlink(char *n)
+/* Do the moves marked R_DIRMOVE starting at first, counting them in *pk,
+   by renaming their source directory to their target, and making the
+   source again, empty, with its old permissions. Return the last of them,
+   or NULL, with the marks cleared, if they must be done one by one. */
+static REP *dirmove(REP *first, unsigned *pk)
+{
+	DIRINFO *d = first->r_hfrom->h_di, *t = first->r_hto->h_di;
+	struct stat dstat, nstat;
+	unsigned n = 1;
+	int fd;
+	REP *last, *p;
+
+	for (
+		last = first;
+		last->r_next != NULL && (last->r_next->r_flags & R_DIRMOVE) &&
+		last->r_next->r_hfrom->h_di == d;
+		last = last->r_next
+	)
+		n++;
+
+	if (!noex) {
+		throttle(&opbucket, 1);
+		if (
+			fstat(dfd(d), &dstat) || !remakeable(d, &dstat) ||
+			dmake(t->di_parent) ||
+			renamexcl(AT_FDCWD, d->di_path, AT_FDCWD, t->di_path)
+		) {
+			for (p = first; ; p = p->r_next) {
+				p->r_flags &= ~R_DIRMOVE;
+				if (p == last)
+					break;
+			}
+			return(NULL);
+		}
+		/* d's descriptor now leads to t, and d is to be made again. */
+		if ((fd = d->di_fd) >= 0) {
+			lruunlink(d);
+			ndirfds--;
+			d->di_fd = -1;
+		}
+		t->di_vid = dstat.st_dev;
+		t->di_did = dstat.st_ino;
+		t->di_flags &= (unsigned short)~DI_NONEXISTENT;
+		if (fd >= 0)
+			dsetfd(t, fd);
+		if (
+			mkdirat(AT_FDCWD, d->di_path, S_IRWXU) ||
+			(fd = open(d->di_path, O_RDONLY | O_DIRECTORY)) < 0
+		)
+			fprintf(stderr, "Strange, couldn't make directory %s again.\n",
+				d->di_path);
+		else {
+			if (fchown(fd, dstat.st_uid, dstat.st_gid) || fchmod(fd, dstat.st_mode & 07777))
+				fprintf(stderr, "Strange, couldn't restore the owner and mode of %s.\n",
+					d->di_path);
+			if (fstat(fd, &nstat) == 0) {
+				d->di_vid = nstat.st_dev;
+				d->di_did = nstat.st_ino;
+			}
+			dsetfd(d, fd);
+		}
+		for (p = first; ; p = p->r_next) {
+			p->r_flags |= R_DONE;
+			if (p == last)
+				break;
+		}
+	}
+	if (verbose || noex)
+		printf("%s -> %s (directory)%s\n", first->r_hfrom->h_name,
+			first->r_hto->h_name, noex ? "" : " : done");
+	*pk += n;
+	return(last);
+}
+
+/* Coalesced appends
+
+   Consecutive appends to the same target, as in mmv -a '*.log' all, are
+   done through a single descriptor for the target, which is extended once,
+   by the summed sizes of the sources, before they are streamed into it in
+   order. Only single appends that do not take part in a cycle are grouped;
+   the rest go through copy() one at a time. */
+
+static int groupable(REP *first)
+{
+	return(
+		first != NULL && first->r_thendo == NULL &&
+		!(first->r_flags & (R_ISCYCLE | R_ISALIASED)) &&
+		!(first->r_hto->h_di->di_flags & DI_NONEXISTENT)
+	);
+}
+
+static int sametarget(REP *p, REP *q)
+{
+	return(p->r_hto->h_di == q->r_hto->h_di && strcmp(p->r_nto, q->r_nto) == 0);
+}
+
+/* Do the appends grouped with first, counting them in *pk, and return the
+   last of them. */
+static REP *appendgroup(REP *first, unsigned *pk)
+{
+	DIRINFO *dto = first->r_hto->h_di;
+	int f, t, tfd = dfd(dto), bad = 0;
+	off_t total = 0;
+	struct stat sstat;
+	REP *last, *p;
+
+	for (last = first; ; last = last->r_next) {
+		DIRINFO *d = last->r_hfrom->h_di;
+		if (fstatat(dfd(d), FNAME(d, last->r_ffrom), &sstat, 0) == 0)
+			total += sstat.st_size;
+		if (!groupable(last->r_next) || !sametarget(first, last->r_next))
+			break;
+	}
+
+	mode_t fmode = first->r_hfrom->h_di->di_mode[first->r_ffrom];
+	t = tfd < 0 ? -1 : openat(tfd, first->r_nto, O_CREAT | O_WRONLY,
+		(~oldumask & RWMASK) | (fmode & (mode_t)~RWMASK));
+	if (t >= 0)
+		prealloc(t, lseek(t, (off_t)0, SEEK_END), total);
+
+	for (p = first; ; p = p->r_next) {
+		if (gotsig) {
+			fflush(stdout);
+			fprintf(stderr, "User break.\n");
+			snap(p, p);
+			gotsig = 0;
+		}
+		if (!noex) {
+			throttle(&opbucket, 1);
+			if (prefetchdepth > 0)
+				prefetch(p, p);
+			DIRINFO *d = p->r_hfrom->h_di;
+			bad = t < 0 ||
+				(f = openat(dfd(d), FNAME(d, p->r_ffrom), O_RDONLY | O_BINARY, 0)) < 0;
+			if (!bad) {
+				bad = copyrange(f, t, (off_t)-1) != 0;
+				close(f);
+			}
+			if (bad) {
+				repnames(p, FNAME(d, p->r_ffrom));
+				fprintf(stderr, "%s -> %s has failed.\n", pathbuf, fullrep);
+				snap(p, p);
+			}
+			else {
+				p->r_flags |= R_DONE;
+				jprogress(0);
+			}
+		}
+		if (verbose || noex) {
+			repnames(p, FNAME(p->r_hfrom->h_di, p->r_ffrom));
+			printf("%s -> %s%s\n", pathbuf, fullrep, noex ? "" : " : done");
+		}
+		(*pk)++;
+		if (p == last)
+			break;
+	}
+	if (t >= 0)
+		close(t);
+	return(last);
+}
+
+/* Fan-out copies
+
+   When several TO patterns are given, the copies of each source are made
+   together: targets are cloned from the source where the filesystem can
+   share its extents, and the rest are written from a single read of it.
+   Sparse sources are instead copied to each target in turn, keeping their
+   holes. */
+
+static int samesource(REP *p, REP *q)
+{
+	return(p->r_hfrom->h_di == q->r_hfrom->h_di && p->r_ffrom == q->r_ffrom);
+}
+
+/* Do the copies grouped with first, counting them in *pk, and return the
+   last of them. */
+static REP *fanout(REP *first, unsigned *pk)
+{
+	DIRINFO *d = first->r_hfrom->h_di;
+	const char *sname = FNAME(d, first->r_ffrom);
+	mode_t fmode = d->di_mode[first->r_ffrom];
+	mode_t perm = (op & OVERWRITE) ?
+		(~oldumask & RWMASK) | (fmode & (mode_t)~RWMASK) :
+		fmode;
+	unsigned n = 1, i, left = 0;
+	int f, *t, sparse = 0;
+	struct stat sstat;
+	REP *last, *p;
+
+	for (last = first; groupable(last->r_next) && samesource(first, last->r_next); last = last->r_next)
+		n++;
+	t = (int *)xnmalloc(n, sizeof(int));
+
+	if (gotsig) {
+		fflush(stdout);
+		fprintf(stderr, "User break.\n");
+		snap(first, first);
+		gotsig = 0;
+	}
+	if (!noex) {
+		if (prefetchdepth > 0)
+			prefetch(first, first);
+		if ((f = openat(dfd(d), sname, O_RDONLY | O_BINARY, 0)) >= 0 && fstat(f, &sstat)) {
+			close(f);
+			f = -1;
+		}
+		if (f >= 0)
+			sparse = issparse(f, &sstat);
+		for (p = first, i = 0; i < n; p = p->r_next, i++) {
+			throttle(&opbucket, 1);
+			int tfd = dfd(p->r_hto->h_di);
+			if (tfd >= 0 && p->r_fdel != NOFILE && !(op & OVERWRITE))
+				myunlink(tfd, p->r_nto, p->r_hto->h_name);
+			t[i] = (f < 0 || tfd < 0) ? -1 :
+				openat(tfd, p->r_nto, O_CREAT | O_TRUNC | O_WRONLY, perm);
+			if (t[i] < 0)
+				continue;
+#ifdef FICLONE
+			if (ioctl(t[i], FICLONE, f) == 0) {
+				p->r_flags |= R_DONE;
+				continue;
+			}
+#endif
+#ifdef SEEK_HOLE
+			if (sparse) {
+				if (lseek(f, 0, SEEK_SET) == 0 && copysparse(f, t[i], sstat.st_size) == 0)
+					p->r_flags |= R_DONE;
+				continue;
+			}
+#endif
+			prealloc(t[i], 0, sstat.st_size);
+			left++;
+		}
+
+		if (f >= 0 && !sparse && left > 0) {
+			char buf[BUFSIZ];
+			ssize_t k;
+			while ((k = read(f, buf, BUFSIZ)) > 0)
+				for (p = first, i = 0; i < n; p = p->r_next, i++)
+					if (t[i] >= 0 && !(p->r_flags & R_DONE)) {
+						if (write(t[i], buf, (size_t)k) != k) {
+							close(t[i]);
+							unlinkat(dfd(p->r_hto->h_di), p->r_nto, 0);
+							t[i] = -1;
+						}
+						else
+							copied(k);
+					}
+			for (p = first, i = 0; i < n; p = p->r_next, i++)
+				if (k == 0 && t[i] >= 0)
+					p->r_flags |= R_DONE;
+		}
+
+		for (p = first, i = 0; i < n; p = p->r_next, i++) {
+			if (t[i] < 0)
+				continue;
+			if ((p->r_flags & R_DONE) && !(op & OVERWRITE)) {
+				struct timespec tim[2];
+				tim[0] = get_stat_atime(&sstat);
+				tim[1] = get_stat_mtime(&sstat);
+				if (futimens(t[i], tim)) {
+					repnames(p, sname);
+					fprintf(stderr, "Strange, couldn't transfer time from %s to %s.\n",
+						pathbuf, fullrep);
+				}
+			}
+			close(t[i]);
+			if (!(p->r_flags & R_DONE))
+				unlinkat(dfd(p->r_hto->h_di), p->r_nto, 0);
+		}
+		if (f >= 0)
+			close(f);
+
+		for (p = first, i = 0; i < n; p = p->r_next, i++)
+			if (!(p->r_flags & R_DONE) && !noex) {
+				repnames(p, sname);
+				fprintf(stderr, "%s -> %s has failed.\n", pathbuf, fullrep);
+				snap(p, p);
+			}
+	}
+
+	for (p = first, i = 0; i < n; p = p->r_next, i++) {
+		if (verbose || (noex && !(p->r_flags & R_DONE))) {
+			repnames(p, sname);
+			printf("%s -> %s%s%s\n", pathbuf, fullrep,
+				p->r_fdel != NOFILE ? " (*)" : "",
+				(p->r_flags & R_DONE) ? " : done" : "");
+		}
+		(*pk)++;
+	}
+	free(t);
+	return(last);
+}
+
+static int copymove(REP *p)
+{
+	const char *sname = FNAME(p->r_hfrom->h_di, p->r_ffrom);
+
+	hashing = verify;
+	int res = copy(p, sname, -1L);
+	hashing = 0;
+	return(
+		res ||
+		myunlink(dfd(p->r_hfrom->h_di), sname, p->r_hfrom->h_name)
+	);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* io_uring back end
+
+   With --io-uring, chains that consist only of renames and links are
+   queued on an io_uring and submitted in batches. The operations of a chain
+   are linked so that they run in order, and a failure cancels the rest of
+   its chain; separate chains are independent, so they may run concurrently.
+   Results are reported in plan order once a batch has completed, every
+   chain in it by what became of it; if any failed, no chain is queued
+   after it. */
+
+#define RINGENTRIES 256
+
+typedef struct {
+	REP *ro_first, *ro_rep;
+	char *ro_from, *ro_to;
+	int ro_res, ro_unlinkres;
+} RINGOP;
+
+typedef struct {
+	int rg_fd;
+	unsigned rg_entries;
+	unsigned *rg_sqhead, *rg_sqtail, *rg_sqmask, *rg_sqarray;
+	struct io_uring_sqe *rg_sqes;
+	unsigned *rg_cqhead, *rg_cqtail, *rg_cqmask;
+	struct io_uring_cqe *rg_cqes;
+	unsigned rg_nsqes;		/* queued but not yet submitted */
+	RINGOP *rg_ops;
+	unsigned rg_nops;
+} RING;
+
+static RING *ring = NULL;
+
+#define RO_UNLINK 0x80000000u
+
+static int ringsetup(void)
+{
+	struct io_uring_params p;
+	RING *r;
+
+	memset(&p, 0, sizeof(p));
+	int fd = (int)syscall(__NR_io_uring_setup, RINGENTRIES, &p);
+	if (fd < 0)
+		return(-1);
+
+	/* Check that the kernel supports all the operations we use. */
+	size_t probelen = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = (struct io_uring_probe *)xzalloc(probelen);
+	static const unsigned char needops[] = {
+		IORING_OP_RENAMEAT, IORING_OP_UNLINKAT, IORING_OP_LINKAT, IORING_OP_SYMLINKAT,
+	};
+	int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+	for (size_t i = 0; ok && i < sizeof(needops); i++)
+		ok = needops[i] <= probe->last_op &&
+			(probe->ops[needops[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	if (!ok) {
+		close(fd);
+		return(-1);
+	}
+
+	size_t sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sqlen = cqlen = sqlen > cqlen ? sqlen : cqlen;
+	char *sq = mmap(NULL, sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		fd, IORING_OFF_SQ_RING);
+	char *cq = sq;
+	if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+		cq = mmap(NULL, cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+		close(fd);
+		return(-1);
+	}
+
+	ring = r = (RING *)xzalloc(sizeof(RING));
+	r->rg_fd = fd;
+	r->rg_entries = p.sq_entries;
+	r->rg_sqhead = (unsigned *)(sq + p.sq_off.head);
+	r->rg_sqtail = (unsigned *)(sq + p.sq_off.tail);
+	r->rg_sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->rg_sqarray = (unsigned *)(sq + p.sq_off.array);
+	r->rg_sqes = (struct io_uring_sqe *)sqes;
+	r->rg_cqhead = (unsigned *)(cq + p.cq_off.head);
+	r->rg_cqtail = (unsigned *)(cq + p.cq_off.tail);
+	r->rg_cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->rg_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->rg_ops = (RINGOP *)xnmalloc(r->rg_entries, sizeof(RINGOP));
+	return(0);
+}
+
+static struct io_uring_sqe *ringsqe(unsigned char opcode, uint64_t data, unsigned char flags)
+{
+	unsigned tail = *ring->rg_sqtail + ring->rg_nsqes++;
+	unsigned i = tail & *ring->rg_sqmask;
+	struct io_uring_sqe *sqe = &ring->rg_sqes[i];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->flags = flags;
+	sqe->user_data = data;
+	sqe->fd = AT_FDCWD;
+	ring->rg_sqarray[i] = i;
+	return(sqe);
+}
+
+static void ringreport(RINGOP *ro, const char *how)
+{
+	REP *p = ro->ro_rep;
+
+	printf("%s %c%c %s%s%s\n",
+		ro->ro_from,
+		p->r_flags & R_ISALIASED ? '=' : '-',
+		p->r_flags & R_ISCYCLE ? '^' : '>',
+		ro->ro_to,
+		(p->r_fdel != NOFILE && !(op & APPEND)) ? " (*)" : "",
+		how);
+}
+
+/* Submit the queued operations, wait for them all, and report them. */
+static void ringflush(void)
+{
+	RINGOP *ro, *bad = NULL;
+	unsigned nsqes, unsubmitted, done;
+
+	if (ring == NULL || (nsqes = unsubmitted = ring->rg_nsqes) == 0)
+		return;
+	__atomic_store_n(ring->rg_sqtail, *ring->rg_sqtail + nsqes, __ATOMIC_RELEASE);
+	ring->rg_nsqes = 0;
+	for (done = 0; done < nsqes; ) {
+		unsigned head = *ring->rg_cqhead;
+		unsigned tail = __atomic_load_n(ring->rg_cqtail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			long n = syscall(__NR_io_uring_enter, ring->rg_fd, unsubmitted, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+			if (n >= 0)
+				unsubmitted -= (unsigned)n;
+			else if (errno != EINTR) {
+				fprintf(stderr, "Strange, io_uring has failed: %s.\n", strerror(errno));
+				exit(2);
+			}
+			continue;
+		}
+		for (; head != tail; head++, done++) {
+			struct io_uring_cqe *cqe = &ring->rg_cqes[head & *ring->rg_cqmask];
+			uint64_t data = cqe->user_data;
+			ro = &ring->rg_ops[data & ~(uint64_t)RO_UNLINK];
+			if (data & RO_UNLINK)
+				ro->ro_unlinkres = cqe->res;
+			else
+				ro->ro_res = cqe->res;
+		}
+		__atomic_store_n(ring->rg_cqhead, head, __ATOMIC_RELEASE);
+	}
+
+	for (ro = ring->rg_ops; ro < ring->rg_ops + ring->rg_nops; ro++) {
+		if (ro->ro_unlinkres < 0 && ro->ro_unlinkres != -ECANCELED)
+			fprintf(stderr, "Strange, cannot unlink %s.\n", ro->ro_to);
+		if (ro->ro_res == 0) {
+			ro->ro_rep->r_flags |= R_DONE;
+			if (verbose)
+				ringreport(ro, " : done");
+		}
+		else if (ro->ro_res != -ECANCELED) {
+			fprintf(stderr, "%s -> %s has failed.\n", ro->ro_from, ro->ro_to);
+			if (bad == NULL)
+				bad = ro;
+		}
+	}
+	if (bad != NULL) {
+		fflush(stdout);
+		snap(bad->ro_first, bad->ro_rep);
+		for (ro = ring->rg_ops; ro < ring->rg_ops + ring->rg_nops; ro++)
+			if (!(ro->ro_rep->r_flags & R_DONE))
+				ringreport(ro, "");
+	}
+	for (ro = ring->rg_ops; ro < ring->rg_ops + ring->rg_nops; ro++) {
+		free(ro->ro_from);
+		free(ro->ro_to);
+	}
+	ring->rg_nops = 0;
+}
+
+/* Can a chain be done on the ring? */
+static int ringable(REP *first)
+{
+	unsigned n = 0;
+
+	if (ring == NULL || noex || gotsig || opbucket.tb_rate > 0 || !(op & (MOVE | LINK)))
+		return(0);
+	for (REP *p = first; p != NULL; p = p->r_thendo, n += 2)
+		if (
+			(p->r_flags & (R_ISCYCLE | R_ISALIASED)) ||
+			((op & XMOVE) && p->r_hto->h_di->di_vid != p->r_hfrom->h_di->di_vid)
+		)
+			return(0);
+	return(n <= ring->rg_entries);
+}
+
+/* Queue a chain on the ring, and return its length; 0 if the batch it
+   would not fit in has failed, so that nothing more is to be done. */
+static unsigned ringchain(REP *first)
+{
+	unsigned n = 0, nsqes = 0;
+
+	for (REP *p = first; p != NULL; p = p->r_thendo)
+		nsqes += (p->r_fdel != NOFILE) ? 2 : 1;
+	if (ring->rg_nsqes + nsqes > ring->rg_entries) {
+		ringflush();
+		if (noex)
+			return(0);
+	}
+
+	for (REP *p = first; p != NULL; p = p->r_thendo, n++) {
+		unsigned i = ring->rg_nops++;
+		RINGOP *ro = &ring->rg_ops[i];
+		struct io_uring_sqe *sqe;
+
+		if (mkdirs && p->r_hto->h_di->di_flags & DI_NONEXISTENT) {
+			if (verbose)
+				printf("creating directory %s\n", p->r_hto->h_name);
+			make_directory(p->r_hto);
+		}
+		ro->ro_first = first;
+		ro->ro_rep = p;
+		ro->ro_res = ro->ro_unlinkres = 0;
+		ro->ro_to = xcharalloc(strlen(p->r_hto->h_name) + strlen(p->r_nto) + 1);
+		strcpy(ro->ro_to, p->r_hto->h_name);
+		strcat(ro->ro_to, p->r_nto);
+		char *fname = FNAME(p->r_hfrom->h_di, p->r_ffrom);
+		ro->ro_from = xcharalloc(strlen(p->r_hfrom->h_name) + strlen(fname) + 1);
+		strcpy(ro->ro_from, p->r_hfrom->h_name);
+		strcat(ro->ro_from, fname);
+
+		/* As when done one at a time, a failed unlink does not stop the
+		   operation, but a failed operation stops the rest of its chain. */
+		unsigned char link = p->r_thendo != NULL ? IOSQE_IO_LINK : 0;
+		if (p->r_fdel != NOFILE && !(op & (APPEND | OVERWRITE))) {
+			sqe = ringsqe(IORING_OP_UNLINKAT, i | RO_UNLINK, IOSQE_IO_HARDLINK);
+			sqe->addr = (uint64_t)(uintptr_t)ro->ro_to;
+		}
+		if (op & MOVE)
+			sqe = ringsqe(IORING_OP_RENAMEAT, i, link);
+		else if (op & HARDLINK)
+			sqe = ringsqe(IORING_OP_LINKAT, i, link);
+		else {
+			sqe = ringsqe(IORING_OP_SYMLINKAT, i, link);
+			sqe->addr = (uint64_t)(uintptr_t)((p->r_flags & R_ONEDIRLINK) ?
+				ro->ro_from + strlen(p->r_hfrom->h_name) : ro->ro_from);
+			sqe->addr2 = (uint64_t)(uintptr_t)ro->ro_to;
+			continue;
+		}
+		sqe->addr = (uint64_t)(uintptr_t)ro->ro_from;
+		sqe->addr2 = (uint64_t)(uintptr_t)ro->ro_to;
+		sqe->len = (uint32_t)AT_FDCWD;
+	}
+	return(n);
+}
+#endif
+
+/* Do p, whose source is now called sname; nonzero if it has failed. */
+static int doaction(REP *p, const char *sname, long aliaslen)
+{
+	char *fstart;
+	DIRINFO *dto = p->r_hto->h_di;
+	int sfd = dfd(p->r_hfrom->h_di);
+	int tfd = (dto->di_flags & DI_NONEXISTENT) ? -1 : dfd(dto);
+
+	if (tfd >= 0 && p->r_fdel != NOFILE && !(op & (APPEND | OVERWRITE)))
+		myunlink(tfd, p->r_nto, p->r_hto->h_name);
+	return(
+		tfd < 0 ||
+		((op & (COPY | APPEND)) ?
+			copy(p, sname, aliaslen) :
+		(op & HARDLINK) ?
+			linkat(sfd, sname, tfd, p->r_nto, 0) :
+		(op & SYMLINK) ?
+			(fstart = repnames(p, sname),
+			 symlinkat((p->r_flags & R_ONEDIRLINK) ? fstart : pathbuf,
+				tfd, p->r_nto)) :
+		p->r_hto->h_di->di_vid != p->r_hfrom->h_di->di_vid ?
+			copymove(p) :
+		/* move */
+			renameat(sfd, sname, tfd, p->r_nto))
+	);
+}
+
+static void showrep(REP *p, const char *sname)
+{
+	repnames(p, sname);
+	printf("%s %c%c %s%s%s\n",
+		pathbuf,
+		p->r_flags & R_ISALIASED ? '=' : '-',
+		p->r_flags & R_ISCYCLE ? '^' : '>',
+		fullrep,
+		(p->r_fdel != NOFILE && !(op & APPEND)) ? " (*)" : "",
+		noex ? "" : " : done");
+}
+
+/* Streaming
+
+   With --stream, an action whose target directory was empty or missing
+   when it was first read is done as soon as it is matched, rather than
+   after the whole job has been planned: nothing can be in the way of its
+   target, and as no source is in that directory, no other action can
+   depend on it, so doing it first cannot change what any other action
+   does. Appends, which may be coalesced, are always planned.
+
+   In place of the collision check, the 64-bit hashes of the targets of the
+   actions streamed so far are kept in an open-addressed set, so that
+   memory grows by only a word per action. A repeated hash is taken to be
+   a collision if the target is already there, or cannot be looked at
+   because nothing is being done; unlike in checkcollisions, the first of
+   the colliding actions has then been done. The rest of the job is planned
+   and done as usual once matching has finished. The source of a streamed
+   action is marked with STREAMREP so that it is not matched again, and the
+   actions done are logged to a temporary file rather than kept, so that
+   they can still be listed if the job stops. */
+
+static uint64_t *seen = NULL;
+static size_t nseen = 0, seenroom = 0;
+
+static _GL_ATTRIBUTE_PURE uint64_t seenhash(const REP *p)
+{
+	uint64_t h = fnv1a(0xcbf29ce484222325ULL ^ (uint64_t)(uintptr_t)p->r_hto->h_di, p->r_nto);
+
+	return(h == 0 ? 1 : h);
+}
+
+/* Add h to the set; 0 if it was already there. */
+static int seenadd(uint64_t h)
 {
-	if (unlink(n)) {
-		fprintf(stderr, "Strange, cannot unlink %s.\n", n);
-		return(-1);
+	size_t i;
+
+	if (2 * (nseen + 1) > seenroom) {
+		uint64_t *old = seen;
+		size_t oldroom = seenroom;
+		seenroom = seenroom == 0 ? 1024 : 2 * seenroom;
+		seen = (uint64_t *)xcalloc(seenroom, sizeof(uint64_t));
+		for (size_t j = 0; j < oldroom; j++)
+			if (old[j] != 0) {
+				for (i = old[j] & (seenroom - 1); seen[i] != 0; i = (i + 1) & (seenroom - 1))
+					;
+				seen[i] = old[j];
+			}
+		free(old);
 	}
-	return(0);
+	for (i = h & (seenroom - 1); seen[i] != 0; i = (i + 1) & (seenroom - 1))
+		if (seen[i] == h)
+			return(0);
+	seen[i] = h;
+	nseen++;
+	return(1);
 }
 
-static int copymove(REP *p)
+/* Can p be done before everything else? */
+static int streamable(const REP *p)
 {
-	return(copy(p->r_ffrom, -1L) || myunlink(pathbuf));
+	const DIRINFO *dto = p->r_hto->h_di;
+
+	if ((op & APPEND) || p->r_fdel != NOFILE)
+		return(0);
+	for (FILENO f = 0; f < dto->di_nfils; f++)
+		if (!isdots(FNAME(dto, f)))
+			return(0);
+	return(1);
+}
+
+/* Do p now if it is streamable, and free it; 0 if it is to be planned. */
+static int streamrep(REP *p)
+{
+	DIRINFO *dfrom = p->r_hfrom->h_di;
+	char *fname = FNAME(dfrom, p->r_ffrom);
+	struct stat tstat;
+	int res = 0;
+
+	if (!streamable(p))
+		return(0);
+	if (
+		!seenadd(seenhash(p)) &&
+		(
+			noex || shardn != 0 ||
+			p->r_hto->h_di->di_flags & DI_NONEXISTENT ||
+			fstatat(dfd(p->r_hto->h_di), p->r_nto, &tstat, AT_SYMLINK_NOFOLLOW) == 0
+		)
+	) {
+		repnames(p, fname);
+		printf("%s -> %s : collision with an earlier action.\n", pathbuf, fullrep);
+		badreps++;
+	}
+	else if (shardn == 0 || inshard(p)) {
+		if (gotsig) {
+			fflush(stdout);
+			fprintf(stderr, "User break.\n");
+			snap(p, p);
+			gotsig = 0;
+		}
+		if (mkdirs && p->r_hto->h_di->di_flags & DI_NONEXISTENT) {
+			if (verbose)
+				printf("creating directory %s\n", p->r_hto->h_name);
+			make_directory(p->r_hto);
+		}
+		if (!noex) {
+			if (nstreamdone == 0)
+				signal(SIGINT, breakrep);
+			throttle(&opbucket, 1);
+			if ((res = doaction(p, fname, -1L)) != 0) {
+				repnames(p, fname);
+				fprintf(stderr, "%s -> %s has failed.\n", pathbuf, fullrep);
+				snap(p, p);
+			}
+			else {
+				nstreamdone++;
+				if (streamlog == NULL && (streamlog = tmpfile()) == NULL)
+					fprintf(stderr, "Strange, couldn't make a log of the actions streamed.\n");
+				if (streamlog != NULL) {
+					repnames(p, fname);
+					fprintf(streamlog, "%s -> %s : done\n", pathbuf, fullrep);
+				}
+			}
+		}
+		if (!res && (op & MOVE))
+			dfrom->di_stflags[p->r_ffrom] |= FI_GONE;
+		if (verbose || noex)
+			showrep(p, fname);
+		nstreamed++;
+	}
+	free(p->r_nto);
+	free(p);
+	return(1);
 }
 
 static void doreps(void)
 {
-	char *fstart;
+	char aliasname[STRLEN(TEMP) + 12];
 	unsigned k;
 	int printaliased = 0, alias = 0;
 	REP *first, *p;
 	long aliaslen = 0l;
 
+	doing = 1;
 	signal(SIGINT, breakrep);
+	if (!stream)
+		clock_gettime(CLOCK_MONOTONIC, &stats.st_start);
 
 	for (first = hrep.r_next, k = 0; first != NULL; first = first->r_next) {
+		jprogress(0);
+		if ((first->r_flags & R_DIRMOVE) && !gotsig) {
+			REP *last = dirmove(first, &k);
+			if (last != NULL) {
+				first = last;
+				continue;
+			}
+		}
+#ifdef HAVE_LINUX_IO_URING_H
+		unsigned n;
+		if (ringable(first) && (n = ringchain(first)) != 0) {
+			k += n;
+			continue;
+		}
+		ringflush();
+#endif
+		if (
+			(op & APPEND) && !noex && !gotsig && groupable(first) &&
+			groupable(first->r_next) && sametarget(first, first->r_next)
+		) {
+			first = appendgroup(first, &k);
+			continue;
+		}
+		if (
+			(op & COPY) && ntos > 1 && !directio && !noex && !gotsig &&
+			groupable(first) && groupable(first->r_next) &&
+			samesource(first, first->r_next)
+		) {
+			first = fanout(first, &k);
+			continue;
+		}
 		for (p = first; p != NULL; p = p->r_thendo, k++) {
+			jprogress(0);
 			if (gotsig) {
 				fflush(stdout);
 				fprintf(stderr, "User break.\n");
 				printaliased = snap(first, p);
 				gotsig = 0;
 			}
-			strcpy(fullrep, p->r_hto->h_name);
 			if (mkdirs && p->r_hto->h_di->di_flags & DI_NONEXISTENT) {
 				if (verbose)
 					printf("creating directory %s\n", p->r_hto->h_name);
-				// FIXME: check the return value.
 				make_directory(p->r_hto);
-				p->r_hto->h_di->di_flags &= ~DI_NONEXISTENT;
 			}
-			strcat(fullrep, p->r_nto);
-			if (!noex && (p->r_flags & R_ISCYCLE)) {
-				if (op & APPEND)
+			if (!noex && p == jcycle) {
+				alias = jalias;
+				aliaslen = jaliaslen;
+			}
+			else if (!noex && (p->r_flags & R_ISCYCLE)) {
+				if (op & APPEND) {
 					aliaslen = appendalias(first, p, &printaliased);
+					jnote(JM_ALIASLEN, k, aliaslen);
+				}
 				else
-					alias = movealias(first, p, &printaliased);
+					alias = movealias(first, p, &printaliased, k);
+			}
+			char *fname = FNAME(p->r_hfrom->h_di, p->r_ffrom);
+			const char *sname = fname;
+			if ((p->r_flags & R_ISALIASED) && !(op & APPEND)) {
+				sprintf(aliasname, "%s%03d", TEMP, alias);
+				sname = aliasname;
 			}
-			strcpy(pathbuf, p->r_hfrom->h_name);
-			fstart = pathbuf + strlen(pathbuf);
-			if ((p->r_flags & R_ISALIASED) && !(op & APPEND))
-				sprintf(fstart, "%s%03d", TEMP, alias);
-			else
-				strcpy(fstart, p->r_ffrom->fi_name);
 			if (!noex) {
-				if (p->r_fdel != NULL && !(op & (APPEND | OVERWRITE)))
-					myunlink(fullrep);
-				if (
-					(op & (COPY | APPEND)) ?
-						copy(p->r_ffrom,
-							p->r_flags & R_ISALIASED ? aliaslen : -1L) :
-					(op & HARDLINK) ?
-						link(pathbuf, fullrep) :
-					(op & SYMLINK) ?
-						symlink((p->r_flags & R_ONEDIRLINK) ? fstart : pathbuf,
-							fullrep) :
-					p->r_hto->h_di->di_vid != p->r_hfrom->h_di->di_vid ?
-						copymove(p) :
-					/* move */
-						rename(pathbuf, fullrep)
-				) {
+				throttle(&opbucket, 1);
+				if (prefetchdepth > 0)
+					prefetch(first, p);
+				if (doaction(p, sname, p->r_flags & R_ISALIASED ? aliaslen : -1L)) {
+					repnames(p, sname);
 					fprintf(stderr,
 						"%s -> %s has failed.\n", pathbuf, fullrep);
 					printaliased = snap(first, p);
 				}
+				else
+					p->r_flags |= R_DONE;
 			}
-			if (verbose || noex) {
-				if (p->r_flags & R_ISALIASED && !printaliased)
-					strcpy(fstart, p->r_ffrom->fi_name);
-				printf("%s %c%c %s%s%s\n",
-					pathbuf,
-					p->r_flags & R_ISALIASED ? '=' : '-',
-					p->r_flags & R_ISCYCLE ? '^' : '>',
-					fullrep,
-					(p->r_fdel != NULL && !(op & APPEND)) ? " (*)" : "",
-					noex ? "" : " : done");
-			}
+			if (verbose || noex)
+				showrep(p, p->r_flags & R_ISALIASED && !printaliased ? fname : sname);
 		}
 		printaliased = 0;
 	}
+#ifdef HAVE_LINUX_IO_URING_H
+	ringflush();
+#endif
+	jprogress(1);
 	if (k != nreps)
 		fprintf(stderr, "Strange, did %u reps; %u were expected.\n",
 			k, nreps);
-	if (k == 0)
+	if (k == 0 && nstreamed == 0)
 		fprintf(stderr, "Nothing done.\n");
+	if (showstats) {
+		unsigned ndone = nstreamdone;
+		for (first = hrep.r_next; first != NULL; first = first->r_next)
+			for (p = first; p != NULL; p = p->r_thendo)
+				ndone += (p->r_flags & R_DONE) != 0;
+		printstats(ndone);
+	}
+	doing = 0;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Watching
+
+   With --watch, once the job has been done, mmv keeps running and does it
+   again, in batches, for files that arrive later. Every directory is
+   watched with inotify from before it is listed, and its listing is then
+   kept up to date from the events rather than read again. A batch starts
+   with the first event after the last batch, and takes in whatever else
+   arrives within the delay. At the last stage of the pattern only the
+   files in the batch are matched: those written and closed, moved in, or
+   made if they are not plain files, apart from the names that the last
+   batch made itself; the directories above them are walked in memory. A
+   plain file that is made is held back, as it may still be written, and
+   only taken if it has not been closed after writing within the delay (a
+   link, say); so are the plain files of a directory first listed while
+   watching. The changes are merged into a listing in place, moving only
+   the entries after the first change and adding names at the end of the
+   names, which are only laid out again when they have run out of room. If
+   the kernel's event queue overflows, each watched directory is read again
+   and all of it is matched. */
+
+#define WMASK (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR)
+#define WDELAY 200
+
+typedef struct {
+	DIRINFO *we_di;
+	char *we_name;
+	size_t we_seq;
+	unsigned char we_there;		/* the name is there after the event */
+	unsigned char we_new;		/* and is to be matched */
+	unsigned char we_type;
+} WEVENT;
+
+static DIRINFO **wdirs = NULL;		/* by watch descriptor */
+static size_t wdroom = 0;
+static WEVENT *wevs = NULL;
+static size_t nwevs = 0, wevroom = 0;
+static uint64_t *wours = NULL;		/* names made by the last batch, sorted */
+static size_t nwours = 0, woursroom = 0;
+static int woverflow = 0;
+static size_t wseq = 0;				/* of the next event */
+
+typedef struct {
+	DIRINFO *wp_di;
+	char *wp_name;
+	size_t wp_seq;			/* events from this one on are about it */
+	struct timespec wp_t;	/* when it was held back */
+} WPEND;
+
+static WPEND *wpend = NULL;			/* plain files held back, oldest first */
+static size_t nwpend = 0, wpendroom = 0;
+
+static void wadd(DIRINFO *di)
+{
+	int wd = inotify_add_watch(watchfd, di->di_path, WMASK);
+
+	if (wd < 0) {
+		fprintf(stderr, "Can't watch %s (%s); files arriving there will be missed.\n",
+			di->di_path, strerror(errno));
+		return;
+	}
+	while ((size_t)wd >= wdroom) {
+		size_t oldroom = wdroom;
+		wdirs = (DIRINFO **)x2nrealloc(wdirs, &wdroom, sizeof(DIRINFO *));
+		memset(wdirs + oldroom, 0, (wdroom - oldroom) * sizeof(DIRINFO *));
+	}
+	/* The same directory reached by another name keeps its first listing. */
+	if (wdirs[wd] == NULL)
+		wdirs[wd] = di;
+}
+
+static _GL_ATTRIBUTE_PURE uint64_t wnamehash(const DIRINFO *d, const char *name)
+{
+	return(fnv1a(0xcbf29ce484222325ULL ^ (uint64_t)d->di_vid ^ ((uint64_t)d->di_did << 17),
+		name));
+}
+
+static int wcmp(const void *p1, const void *p2)
+{
+	uint64_t h1 = *(const uint64_t *)p1, h2 = *(const uint64_t *)p2;
+
+	return(h1 < h2 ? -1 : h1 > h2);
+}
+
+static void woursadd(uint64_t h)
+{
+	if (nwours == woursroom)
+		wours = (uint64_t *)x2nrealloc(wours, &woursroom, sizeof(uint64_t));
+	wours[nwours++] = h;
+}
+
+static void wpendadd(DIRINFO *di, const char *name)
+{
+	if (nwpend == wpendroom)
+		wpend = (WPEND *)x2nrealloc(wpend, &wpendroom, sizeof(WPEND));
+	WPEND *p = &wpend[nwpend++];
+	p->wp_di = di;
+	p->wp_name = xstrdup(name);
+	p->wp_seq = wseq;
+	clock_gettime(CLOCK_MONOTONIC, &p->wp_t);
+}
+
+/* Milliseconds since t. */
+static long wsince(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((long)(now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000);
+}
+
+static WEVENT *wevadd(DIRINFO *di, char *name)
+{
+	if (nwevs == wevroom)
+		wevs = (WEVENT *)x2nrealloc(wevs, &wevroom, sizeof(WEVENT));
+	WEVENT *e = &wevs[nwevs++];
+	e->we_di = di;
+	e->we_name = name;
+	e->we_seq = wseq++;
+	return(e);
+}
+
+/* Is this event for a file that should be matched? */
+static int wnew(DIRINFO *di, const struct inotify_event *ev)
+{
+	struct stat st;
+	uint64_t h = wnamehash(di, ev->name);
+
+	if (
+		strncmp(ev->name, TEMP, STRLEN(TEMP)) == 0 ||
+		(nwours > 0 && bsearch(&h, wours, nwours, sizeof(uint64_t), wcmp) != NULL)
+	)
+		return(0);
+	if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+		return(1);
+	if (!(ev->mask & IN_CREATE))
+		return(0);
+	if (ev->mask & IN_ISDIR)
+		return(1);
+	if (fstatat(dfd(di), ev->name, &st, AT_SYMLINK_NOFOLLOW))
+		return(0);
+	/* A plain file just made may still be being written. */
+	if (S_ISREG(st.st_mode)) {
+		wpendadd(di, ev->name);
+		return(0);
+	}
+	return(1);
+}
+
+/* Hold back the plain files of di, first listed while watching, as they
+   may still be being written; the rest are matched now. */
+static void wfresh(DIRINFO *di)
+{
+	struct stat st;
+	FILENO nnew = 0;
+
+	free(di->di_new);
+	di->di_new = (FILENO *)xnmalloc(di->di_nfils, sizeof(FILENO));
+	for (FILENO f = 0; f < di->di_nfils; f++) {
+		const char *name = FNAME(di, f);
+		if (
+			di->di_type[f] == DT_REG ||
+			(
+				di->di_type[f] == DT_UNKNOWN &&
+				fstatat(dfd(di), name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)
+			)
+		)
+			wpendadd(di, name);
+		else
+			di->di_new[nnew++] = f;
+	}
+	di->di_nnew = nnew;
+}
+
+/* Read the events that are waiting. */
+static void wread(void)
+{
+	union {
+		struct inotify_event ev;
+		char b[65536];
+	} buf;
+	ssize_t n;
+	DIRINFO *di;
+
+	while ((n = read(watchfd, &buf, sizeof(buf))) > 0)
+		for (char *q = buf.b; q < buf.b + n; ) {
+			struct inotify_event *ev = (struct inotify_event *)q;
+			q += sizeof(struct inotify_event) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				woverflow = 1;
+				continue;
+			}
+			if (ev->wd < 0 || (size_t)ev->wd >= wdroom || (di = wdirs[ev->wd]) == NULL)
+				continue;
+			if (ev->mask & IN_IGNORED) {
+				wdirs[ev->wd] = NULL;
+				continue;
+			}
+			if (ev->len == 0 || woverflow)
+				continue;
+			WEVENT *e = wevadd(di, xstrdup(ev->name));
+			e->we_there = (ev->mask & (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO)) != 0;
+			e->we_new = e->we_there && wnew(di, ev);
+			e->we_type = ev->mask & IN_ISDIR ? DT_DIR : DT_UNKNOWN;
+		}
+}
+
+/* Wait for a batch of events; 0 if interrupted. */
+static int wwait(int delay)
+{
+	struct pollfd pfd;
+	struct timespec t0;
+	int started = 0;
+
+	pfd.fd = watchfd;
+	pfd.events = POLLIN;
+	for (;;) {
+		int timeout = -1;
+		/* Held back files are due the delay after the oldest. */
+		if (started || nwpend > 0) {
+			long ms = wsince(started ? &t0 : &wpend[0].wp_t);
+			if (ms >= delay)
+				return(1);
+			timeout = (int)(delay - ms);
+		}
+		int n = poll(&pfd, 1, timeout);
+		if (gotsig)
+			return(0);
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "Strange, can't wait for files (%s).\n", strerror(errno));
+			return(0);
+		}
+		if (n > 0) {
+			wread();
+			if (!started && (nwevs != 0 || woverflow)) {
+				started = 1;
+				clock_gettime(CLOCK_MONOTONIC, &t0);
+			}
+		}
+	}
+}
+
+/* Free a listing, except for the part of it mapped from the cache. */
+static void wfree(DIRINFO *di)
+{
+	if (dcmap == NULL || di->di_names < dcmap || di->di_names >= dcmap + dcsize) {
+		listmem -= dlistsize(di);
+		free(di->di_names);
+		free(di->di_off);
+		free(di->di_len);
+		free(di->di_type);
+	}
+	free(di->di_stflags);
+	free(di->di_mode);
+	free(di->di_rep);
+	di->di_flags &= (unsigned short)~DI_CACHEABLE;
+}
+
+static int wevcmp(const void *p1, const void *p2)
+{
+	const WEVENT *e1 = (const WEVENT *)p1, *e2 = (const WEVENT *)p2;
+	int ret;
+
+	if (e1->we_di != e2->we_di)
+		return((uintptr_t)e1->we_di < (uintptr_t)e2->we_di ? -1 : 1);
+	if ((ret = strcmp(e1->we_name, e2->we_name)) != 0)
+		return(ret);
+	return(e1->we_seq < e2->we_seq ? -1 : e1->we_seq > e2->we_seq);
+}
+
+static int wmapped(const DIRINFO *di)
+{
+	return(dcmap != NULL && di->di_names >= dcmap && di->di_names < dcmap + dcsize);
+}
+
+/* Move cnt entries of the listing of di from src to dst. */
+static void wshift(DIRINFO *di, FILENO dst, FILENO src, FILENO cnt)
+{
+	if (dst == src || cnt == 0)
+		return;
+	memmove(di->di_off + dst, di->di_off + src, cnt * sizeof(uint32_t));
+	memmove(di->di_len + dst, di->di_len + src, cnt * sizeof(unsigned short));
+	memmove(di->di_type + dst, di->di_type + src, cnt);
+	memmove(di->di_stflags + dst, di->di_stflags + src, cnt * sizeof(unsigned short));
+	memmove(di->di_mode + dst, di->di_mode + src, cnt * sizeof(mode_t));
+	memmove(di->di_rep + dst, di->di_rep + src, cnt * sizeof(REPNO));
+}
+
+/* Make room in the listing of di for nfils entries and namesadd more bytes
+   of names, first copying it if it is mapped from the cache. */
+static void wroom(DIRINFO *di, FILENO nfils, size_t namesadd)
+{
+	int mapped = wmapped(di);
+	FILENO n = di->di_nfils;
+
+	if (mapped) {
+		di->di_off = (uint32_t *)memcpy(xnmalloc(n, sizeof(uint32_t)), di->di_off, n * sizeof(uint32_t));
+		di->di_len = (unsigned short *)memcpy(xnmalloc(n, sizeof(unsigned short)), di->di_len,
+			n * sizeof(unsigned short));
+		di->di_type = (unsigned char *)memcpy(xmalloc(n), di->di_type, n);
+		di->di_room = n;
+	}
+	if (nfils > di->di_room) {
+		size_t room = 2 * (size_t)di->di_room;
+		if (room < nfils)
+			room = nfils;
+		if (room >= NOFILE)
+			room = NOFILE - 1;
+		di->di_off = (uint32_t *)xnrealloc(di->di_off, room, sizeof(uint32_t));
+		di->di_len = (unsigned short *)xnrealloc(di->di_len, room, sizeof(unsigned short));
+		di->di_type = (unsigned char *)xrealloc(di->di_type, room);
+		di->di_stflags = (unsigned short *)xnrealloc(di->di_stflags, room, sizeof(unsigned short));
+		di->di_mode = (mode_t *)xnrealloc(di->di_mode, room, sizeof(mode_t));
+		di->di_rep = (REPNO *)xnrealloc(di->di_rep, room, sizeof(REPNO));
+		di->di_room = (FILENO)room;
+	}
+	/* The names of the entries gone are only dropped when laying them out
+	   again, at twice the size of those left. */
+	if (mapped || di->di_nameslen + namesadd > di->di_namesroom) {
+		size_t live = namesadd;
+		for (FILENO f = 0; f < n; f++)
+			live += (size_t)di->di_len[f] + 1;
+		size_t room = live < INITROOM * 16 ? INITROOM * 32 : 2 * live;
+		char *names = xcharalloc(room), *q = names;
+		for (FILENO f = 0; f < n; f++) {
+			memcpy(q, FNAME(di, f), (size_t)di->di_len[f] + 1);
+			di->di_off[f] = (uint32_t)(q - names);
+			q += di->di_len[f] + 1;
+		}
+		if (!mapped)
+			free(di->di_names);
+		di->di_names = names;
+		di->di_nameslen = (size_t)(q - names);
+		di->di_namesroom = room;
+	}
+}
+
+#define WINSERT 1			/* the change adds a name */
+#define WNEW 2				/* the file is to be matched */
+
+/* Merge the changes ch, sorted by name with one per name, into the listing
+   of di, and note which files are new. */
+static void wmerge(DIRINFO *di, const WEVENT *ch, size_t nch)
+{
+	FILENO *at = (FILENO *)xnmalloc(nch, sizeof(FILENO));
+	unsigned char *what = (unsigned char *)xmalloc(nch);
+	FILENO n = di->di_nfils, lo = 0, next = 0, ndel = 0, nins = 0, nnew = 0;
+	size_t namesadd = 0, c;
+	int sticky = dsticky(di);
+
+	if (!wmapped(di))
+		listmem -= dlistsize(di);
+	wroom(di, n, 0);
+
+	/* Find where each change falls, closing up over the names that have
+	   gone; the entries from next on have still to be moved down by ndel. */
+	for (c = 0; c < nch; c++) {
+		const WEVENT *e = &ch[c];
+		FILENO hi = n;
+		while (lo < hi) {
+			FILENO mid = lo + (hi - lo) / 2;
+			if (strcmp(FNAME(di, mid), e->we_name) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		int there = lo < n && strcmp(FNAME(di, lo), e->we_name) == 0;
+		at[c] = lo - ndel;
+		what[c] = e->we_new ? WNEW : 0;
+		if (there && !e->we_there) {
+			wshift(di, next - ndel, next, lo - next);
+			next = lo + 1;
+			ndel++;
+			what[c] = 0;
+		}
+		else if (there) {
+			di->di_type[lo] = e->we_type;
+			di->di_stflags[lo] = (unsigned short)sticky;
+			di->di_mode[lo] = 0;
+		}
+		else if (e->we_there) {
+			what[c] |= WINSERT;
+			nins++;
+			namesadd += strlen(e->we_name) + 1;
+		}
+	}
+	wshift(di, next - ndel, next, n - next);
+	di->di_nfils = n -= ndel;
+
+	if ((size_t)n + nins >= NOFILE) {
+		fprintf(stderr, "Strange, %s has too many entries.\n", di->di_path);
+		quit();
+	}
+	wroom(di, n + nins, namesadd);
+	if (di->di_nameslen + namesadd > UINT32_MAX) {
+		fprintf(stderr, "Strange, %s has too many entries.\n", di->di_path);
+		quit();
+	}
+
+	/* Put in the names added from the last, moving each run of entries up
+	   past the names that go before it. */
+	for (c = nch, next = n; nins > 0 && c-- > 0; )
+		if (what[c] & WINSERT) {
+			FILENO f = at[c] + --nins;
+			size_t l = strlen(ch[c].we_name);
+			wshift(di, f + 1, at[c], next - at[c]);
+			next = at[c];
+			di->di_off[f] = (uint32_t)di->di_nameslen;
+			di->di_len[f] = (unsigned short)l;
+			memcpy(di->di_names + di->di_nameslen, ch[c].we_name, l + 1);
+			di->di_nameslen += l + 1;
+			di->di_type[f] = ch[c].we_type;
+			di->di_stflags[f] = (unsigned short)sticky;
+			di->di_mode[f] = 0;
+			di->di_rep[f] = NOREP;
+			di->di_nfils++;
+		}
+
+	FILENO *fnew = (FILENO *)xnmalloc(nch, sizeof(FILENO));
+	for (c = 0; c < nch; c++) {
+		if (what[c] & WNEW)
+			fnew[nnew++] = at[c] + nins;
+		if (what[c] & WINSERT)
+			nins++;
+	}
+	free(at);
+	free(what);
+	listmem += dlistsize(di);
+	di->di_flags &= (unsigned short)~DI_CACHEABLE;
+	free(di->di_new);
+	di->di_new = fnew;
+	di->di_nnew = nnew;
+}
+
+/* The last event about name in di among the first n of wevs, which are
+   sorted, or NULL. */
+static const WEVENT *wevlast(const DIRINFO *di, const char *name, size_t n)
+{
+	size_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const WEVENT *e = &wevs[mid];
+		if (e->we_di != di ? (uintptr_t)e->we_di < (uintptr_t)di : strcmp(e->we_name, name) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || wevs[lo - 1].we_di != di || strcmp(wevs[lo - 1].we_name, name) != 0)
+		return(NULL);
+	return(&wevs[lo - 1]);
+}
+
+/* Forget the files held back that there have been events about since, and
+   take those held back for the delay as arriving. */
+static void wpendtake(int delay)
+{
+	size_t n = nwevs, kept = 0;
+
+	for (size_t i = 0; i < nwpend; i++) {
+		WPEND *p = &wpend[i];
+		const WEVENT *e = wevlast(p->wp_di, p->wp_name, n);
+		if (e != NULL && e->we_seq >= p->wp_seq)
+			free(p->wp_name);
+		else if (wsince(&p->wp_t) >= delay) {
+			WEVENT *w = wevadd(p->wp_di, p->wp_name);
+			w->we_there = w->we_new = 1;
+			w->we_type = DT_REG;
+		}
+		else
+			wpend[kept++] = *p;
+	}
+	nwpend = kept;
+	if (nwevs > n)
+		qsort(wevs, nwevs, sizeof(WEVENT), wevcmp);
+}
+
+/* Bring the listings up to date with the events read; 0 if nothing in
+   them is to be matched. */
+static int wapply(int delay)
+{
+	int any = 0;
+
+	if (woverflow) {
+		for (size_t i = 0; i < nwpend; i++)
+			free(wpend[i].wp_name);
+		nwpend = 0;
+		for (size_t wd = 0; wd < wdroom; wd++)
+			if (wdirs[wd] != NULL) {
+				wfree(wdirs[wd]);
+				dreload(wdirs[wd]);
+				wdirs[wd]->di_nnew = NOFILE;
+				any = 1;
+			}
+		woverflow = 0;
+	}
+	else {
+		if (nwevs > 0)
+			qsort(wevs, nwevs, sizeof(WEVENT), wevcmp);
+		wpendtake(delay);
+		for (size_t i = 0, j; i < nwevs; i = j) {
+			DIRINFO *di = wevs[i].we_di;
+			size_t n = 0;
+			/* Collapse the events for each name to one in its final state,
+			   swapping names so that each is still freed once. */
+			for (j = i; j < nwevs && wevs[j].we_di == di; n++) {
+				WEVENT *e = &wevs[i + n], *last;
+				size_t k = j;
+				int isnew = 0;
+				for (; j < nwevs && wevs[j].we_di == di &&
+				       strcmp(wevs[j].we_name, wevs[k].we_name) == 0; j++)
+					isnew = wevs[j].we_there && (isnew || wevs[j].we_new);
+				if (e != (last = &wevs[j - 1])) {
+					char *name = e->we_name;
+					e->we_name = last->we_name;
+					last->we_name = name;
+					e->we_there = last->we_there;
+					e->we_type = last->we_type;
+				}
+				e->we_new = (unsigned char)isnew;
+				any |= isnew;
+			}
+			wmerge(di, wevs + i, n);
+		}
+	}
+	for (size_t i = 0; i < nwevs; i++)
+		free(wevs[i].we_name);
+	nwevs = 0;
+	nwours = 0;
+	return(any);
+}
+
+/* List and watch the target directories that have been made. */
+static void wmade(void)
+{
+	DIRINFO *di, *d;
+
+	for (size_t i = 0; i < nhandles; i++)
+		if (
+			(di = handles[i]->h_di) != NULL && di->di_parent != NULL &&
+			!(di->di_flags & DI_NONEXISTENT) && di->di_names == NULL
+		) {
+			if ((d = dsearch(di->di_vid, di->di_did)) != NULL) {
+				handles[i]->h_di = d;
+				continue;
+			}
+			if (ndirs == dirroom)
+				dirs = (DIRINFO **)x2nrealloc(dirs, &dirroom, sizeof(DIRINFO *));
+			dirs[ndirs++] = di;
+			wadd(di);
+			dreload(di);
+			woursadd(wnamehash(di->di_parent, di->di_base));
+		}
+}
+
+/* Forget the actions of a batch, remembering the names they made. */
+static void wdone(void)
+{
+	REP *first, *nfirst, *p, *next;
+
+	wmade();
+	for (first = hrep.r_next; first != NULL; first = nfirst) {
+		nfirst = first->r_next;
+		for (p = first; p != NULL; p = next) {
+			next = p->r_thendo;
+			woursadd(wnamehash(p->r_hto->h_di, p->r_nto));
+			free(p->r_nto);
+			free(p);
+		}
+	}
+	hrep.r_next = NULL;
+	lastrep = &hrep;
+	nreps = 0;
+	nreptab = 3;
+	if (nwours > 0)
+		qsort(wours, nwours, sizeof(uint64_t), wcmp);
+	for (size_t i = 0; i < ndirs; i++) {
+		DIRINFO *di = dirs[i];
+		if (di->di_nnew == NOFILE)
+			memset(di->di_rep, 0, di->di_nfils * sizeof(REPNO));
+		else
+			for (FILENO k = 0; k < di->di_nnew; k++)
+				di->di_rep[di->di_new[k]] = NOREP;
+		free(di->di_new);
+		di->di_new = NULL;
+		di->di_nnew = 0;
+		di->di_flags &= (unsigned short)~DI_NOTWHOLE;
+	}
+}
+
+/* Do the job for files that arrive until interrupted or an action fails. */
+static void watch(int delay)
+{
+	if (jfile != NULL) {
+		fclose(jfile);
+		jfile = NULL;
+	}
+	jcycle = NULL;
+	for (size_t i = 0; i < ndirs; i++)
+		dirs[i]->di_nnew = NOFILE;
+	if (nreps > 0)
+		nbatches++;
+	wdone();
+	watching = 1;
+	signal(SIGINT, breakrep);
+	while (!failed && wwait(delay)) {
+		if (!wapply(delay))
+			continue;
+		badreps = paterr = 0;
+		dostage(from, pathbuf, start, length, 0, 0, 0, NULL, NULL);
+		if (!(op & APPEND))
+			checkcollisions();
+		findorder();
+		if (op & (COPY | LINK))
+			nochains();
+		if (shardn != 0)
+			shard();
+		scandeletes(baddel);
+		goonordie();
+		if (dirrename && (op & MOVE))
+			dirmoves();
+		if (sched)
+			schedule();
+		if (nreps > 0) {
+			doreps();
+			nbatches++;
+		}
+		fflush(stdout);
+		wdone();
+		signal(SIGINT, breakrep);
+	}
 }
+#endif
 
 int main(int argc, char *argv[])
 {
-	char *frompat, *topat;
+	char *frompat, **topats;
+	int badpat;
 
 	set_program_name(argv[0]);
 
@@ -1702,6 +6002,12 @@ int main(int argc, char *argv[])
 	oldumask = umask(0);
 #ifndef _WIN32
 	uid = getuid();
+	gid = getgid();
+	if ((nsupgroups = getgroups(0, NULL)) > 0) {
+		supgroups = (gid_t *)xnmalloc((size_t)nsupgroups, sizeof(gid_t));
+		if ((nsupgroups = getgroups(nsupgroups, supgroups)) < 0)
+			nsupgroups = 0;
+	}
 #endif
 	signal(SIGINT, breakout);
 
@@ -1710,9 +6016,12 @@ int main(int argc, char *argv[])
 	handles = (HANDLE **)xmalloc(handleroom * sizeof(HANDLE *));
 	ndirs = nhandles = 0;
 
-	dirroom_nonexistent = INITROOM;
-	dirs_nonexistent = (DIRINFO **)xmalloc(dirroom_nonexistent * sizeof(DIRINFO *));
-	ndirs_nonexistent = 0;
+	reptabroom = INITROOM;
+	reptab = (REP **)xmalloc(reptabroom * sizeof(REP *));
+	reptab[NOREP] = NULL;
+	reptab[MISTAKEREP] = MISTAKE;
+	reptab[STREAMREP] = NULL;
+	nreptab = 3;
 
 	struct gengetopt_args_info args_info;
 	if (cmdline_parser(argc, argv, &args_info) != 0)
@@ -1722,6 +6031,69 @@ int main(int argc, char *argv[])
 	noex = args_info.dryrun_given != 0;
 	matchall = args_info.hidden_given != 0;
 	mkdirs = args_info.makedirs_given != 0;
+	sched = args_info.schedule_given != 0;
+	dirrename = args_info.dir_rename_given != 0;
+	directio = args_info.direct_given != 0;
+	if ((verify = args_info.verify_given != 0))
+		crcinit();
+	showstats = args_info.stats_given != 0;
+	if (args_info.prefetch_given) {
+		if (args_info.prefetch_arg < 0) {
+			fprintf(stderr, "%d : bad prefetch depth.\n", args_info.prefetch_arg);
+			exit(1);
+		}
+		prefetchdepth = (unsigned)args_info.prefetch_arg;
+	}
+	if (args_info.io_uring_given
+#ifdef HAVE_LINUX_IO_URING_H
+	    && ringsetup() != 0
+#endif
+	    && verbose)
+		fprintf(stderr, "io_uring is not available; doing operations one at a time.\n");
+	regexmode = args_info.regex_given != 0;
+	if (args_info.dircache_given)
+		dcload(args_info.dircache_arg);
+
+	excludes = args_info.exclude_arg;
+	nexcludes = args_info.exclude_given;
+	for (unsigned i = 0; i < nexcludes; i++)
+		if (badexclude(excludes[i])) {
+			fprintf(stderr, "%s : bad exclude pattern.\n", excludes[i]);
+			exit(1);
+		}
+	if (args_info.max_depth_given) {
+		if (args_info.max_depth_arg < 0) {
+			fprintf(stderr, "%d : bad maximum depth.\n", args_info.max_depth_arg);
+			exit(1);
+		}
+		maxdepth = args_info.max_depth_arg;
+	}
+	if (args_info.max_ops_per_sec_given) {
+		if (!(args_info.max_ops_per_sec_arg > 0)) {
+			fprintf(stderr, "%g : bad maximum rate.\n", args_info.max_ops_per_sec_arg);
+			exit(1);
+		}
+		bucketinit(&opbucket, args_info.max_ops_per_sec_arg, 1);
+	}
+	if (args_info.bwlimit_given)
+		bucketinit(&bwbucket, parsesize(args_info.bwlimit_arg), BUFSIZ);
+	if (args_info.max_memory_given)
+		maxmem = (size_t)parsesize(args_info.max_memory_arg);
+	if (args_info.ionice_given)
+		setionice(args_info.ionice_arg);
+	if (args_info.shard_given) {
+		char *end;
+		errno = 0;
+		shardi = strtoul(args_info.shard_arg, &end, 10);
+		if (*end == '/')
+			shardn = strtoul(end + 1, &end, 10);
+		if (errno != 0 || *end != '\0' || shardi < 1 || shardi > shardn) {
+			fprintf(stderr, "%s : bad shard; use I/N, with I from 1 to N.\n",
+				args_info.shard_arg);
+			exit(1);
+		}
+		shardi--;
+	}
 
 	delstyle = ASKDEL;
 	if (args_info.force_given != 0)
@@ -1763,12 +6135,70 @@ int main(int argc, char *argv[])
 			op = XMOVE;
 	}
 
+	if (shardn != 0 && (op & APPEND)) {
+		/* Appends to one file from different shards would be interleaved. */
+		fprintf(stderr, "--shard cannot be used when appending.\n");
+		exit(1);
+	}
+	if (args_info.resume_given && args_info.apply_given) {
+		fprintf(stderr, "--resume and --apply cannot be used together.\n");
+		exit(1);
+	}
+	if ((args_info.resume_given || args_info.apply_given) && args_info.inputs_num != 0) {
+		/* The journal or the plan already says what to do. */
+		fprintf(stderr, "--%s cannot be used with patterns.\n",
+			args_info.resume_given ? "resume" : "apply");
+		exit(1);
+	}
+	if (args_info.watch_given) {
+#ifdef HAVE_SYS_INOTIFY_H
+		if ((watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+			fprintf(stderr, "Can't watch for files (%s).\n", strerror(errno));
+			exit(1);
+		}
+#else
+		fprintf(stderr, "--watch is not supported on this system.\n");
+		exit(1);
+#endif
+		if (args_info.watch_delay_given && args_info.watch_delay_arg < 0) {
+			fprintf(stderr, "%d : bad watch delay.\n", args_info.watch_delay_arg);
+			exit(1);
+		}
+		/* Nobody is there to answer, and listings must stay put. */
+		if (badstyle == ASKBAD)
+			badstyle = SKIPBAD;
+		maxmem = 0;
+	}
 	if (badstyle != ASKBAD && delstyle == ASKDEL)
 		delstyle = NODEL;
-
-	if (args_info.inputs_num == 2) {
+	if (
+		(stream = args_info.stream_given && !(op & APPEND) && badstyle != ABORTBAD &&
+			!args_info.plan_out_given && !dirrename && watchfd < 0)
+	)
+		clock_gettime(CLOCK_MONOTONIC, &stats.st_start);
+
+	if (args_info.resume_given) {
+		jresume(args_info.resume_arg);
+		goonordie();
+		if (!noex)
+			jstart(args_info.journal_given ? args_info.journal_arg : args_info.resume_arg);
+		doreps();
+		if (dcpath != NULL)
+			dcsave();
+		return(failed ? 2 : nreps == 0 && badreps);
+	}
+	if (args_info.apply_given) {
+		planapply(args_info.apply_arg);
+		if (args_info.journal_given && !noex)
+			jstart(args_info.journal_arg);
+		doreps();
+		if (dcpath != NULL)
+			dcsave();
+		return(failed ? 2 : nreps == 0 && badreps);
+	}
+	if (args_info.inputs_num == 2 || (args_info.inputs_num > 2 && (op & COPY))) {
 		frompat = args_info.inputs[0];
-		topat = args_info.inputs[1];
+		topats = args_info.inputs + 1;
 	}
 	else {
 		/* Print message to stderr, not stdout. */
@@ -1777,17 +6207,39 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	domatch(frompat, topat);
+	plantime = time(NULL);
+	badpat = domatch(frompat, topats, args_info.inputs_num - 1);
 	if (!(op & APPEND))
 		checkcollisions();
 	findorder();
 	if (op & (COPY | LINK))
 		nochains();
+	if (shardn != 0)
+		shard();
 	scandeletes(baddel);
 	goonordie();
 	if (!(op & APPEND) && delstyle == ASKDEL)
 		scandeletes(skipdel);
+	if (dirrename && (op & MOVE))
+		dirmoves();
+	if (sched)
+		schedule();
+	if (args_info.plan_out_given) {
+		plansave(args_info.plan_out_arg);
+		return(nreps == 0 && (paterr || badreps));
+	}
+	if (args_info.journal_given && !noex)
+		jstart(args_info.journal_arg);
 	doreps();
+	if (dcpath != NULL)
+		dcsave();
+	if (watchfd >= 0 && !badpat && !failed) {
+		fflush(stdout);
+#ifdef HAVE_SYS_INOTIFY_H
+		watch(args_info.watch_delay_given ? args_info.watch_delay_arg : WDELAY);
+#endif
+		return(failed ? 2 : 0);
+	}
 
-	return(failed ? 2 : nreps == 0 && (paterr || badreps));
+	return(failed ? 2 : nreps == 0 && nstreamed == 0 && (paterr || badreps));
 }